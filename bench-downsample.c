@@ -52,7 +52,7 @@ static void readlines(void)
 }
 
 #define MAXW (1<<20)
-unsigned w[MAXW];
+unsigned w[MAXW], w2[MAXW];
 static volatile unsigned ret;
 
 static void downsample(void)
@@ -64,11 +64,93 @@ static void downsample(void)
     }
 }
 
+// the merge kernels, forced one at a time
+#if defined(__x86_64__) || defined(__i386__)
+static void scalar(void)
+{
+    merge1 = merge1_scalar;
+    downsample();
+}
+
+static void sse41(void)
+{
+    merge1 = merge1_sse41;
+    downsample();
+}
+#endif
+
+// reduce by K bits: K passes out of place, K passes in place,
+// and a single radix pass in place
+static int K;
+
+static void chain(void)
+{
+    for (int i = 0; i < ndd; i++) {
+	struct decoded *d = dd[i];
+	if (d->bpp - K < 7)
+	    continue;
+	assert(d->n <= MAXW);
+	int n = d->n;
+	int bpp = d->bpp;
+	const unsigned *v = d->v;
+	unsigned *w1 = w, *wx = w2;
+	while (bpp > d->bpp - K) {
+	    n = downsample1(v, n, w1, --bpp);
+	    v = w1;
+	    w1 = wx;
+	    wx = (unsigned *) v;
+	}
+	ret += n;
+    }
+}
+
+static void inplace(void)
+{
+    for (int i = 0; i < ndd; i++) {
+	struct decoded *d = dd[i];
+	if (d->bpp - K < 7)
+	    continue;
+	assert(d->n <= MAXW);
+	memcpy(w, d->v, d->n * sizeof(unsigned));
+	size_t n = d->n;
+	for (int k = K; k-- > 0; )
+	    n = downsample1_inplace(w, n, w2, d->bpp - K + k);
+	ret += n;
+    }
+}
+
+static void radix(void)
+{
+    for (int i = 0; i < ndd; i++) {
+	struct decoded *d = dd[i];
+	if (d->bpp - K < 7)
+	    continue;
+	assert(d->n <= MAXW);
+	memcpy(w, d->v, d->n * sizeof(unsigned));
+	ret += downsample_radix(w, d->n, w2, d->bpp - K);
+    }
+}
+
 #include "bench.h"
 
 int main()
 {
     readlines();
     BENCH(downsample);
+#if defined(__x86_64__) || defined(__i386__)
+    BENCH(scalar);
+    if (__builtin_cpu_supports("sse4.1"))
+	BENCH(sse41);
+    init_merge1();
+#endif
+    for (K = 1; K <= 16; K++) {
+	char name[3][32];
+	snprintf(name[0], sizeof name[0], "chain%d", K);
+	snprintf(name[1], sizeof name[1], "inplace%d", K);
+	snprintf(name[2], sizeof name[2], "radix%d", K);
+	bench(chain, name[0]);
+	bench(inplace, name[1]);
+	bench(radix, name[2]);
+    }
     return 0;
 }
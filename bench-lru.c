@@ -1,22 +1,47 @@
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <limits.h>
 
-#define CACHE_SIZE (256 - 1)
+// the number of entries can be changed at runtime
+static int cache_size = 256 - 1;
+#define CACHE_SIZE cache_size
 #define MIDPOINT (CACHE_SIZE * 7 / 8)
 #define MOVSTEP 32
 
 struct cache_ent {
     unsigned fullhash;
+    uint64_t key;
     int len;
     int n;
+    int size;
+};
+
+// GDSF priority and frequency, moved along with the entry
+struct cache_slot {
+    struct cache_ent *ent;
+    float pri;
+    int freq;
 };
 
 struct cache {
-    uint16_t hv[CACHE_SIZE + 1];
+    uint16_t *hv;
     int hc;
     int hit, miss;
-    struct cache_ent *ev[CACHE_SIZE];
+    // decode cost of the hits and of all lookups
+    double hitcost, cost;
+    size_t bytes;
+    float L;
+    struct cache_slot *ev;
 };
 
+// memory budget, and whether to evict by GDSF rather than LRU
+static size_t budget;
+static int gdsf;
+
+// decode cost, in values, incl. the call overhead
+#define COST(n) ((n) + 64)
+
 #include <string.h>
 #include <stdlib.h>
 #define xmalloc malloc
@@ -36,16 +61,58 @@ static inline unsigned hash16(const char *str, unsigned len)
 #include <arm_neon.h>
 #endif
 
+// remove the i-th entry
+static void cache_evict(struct cache *c, int i)
+{
+    struct cache_ent *ent = c->ev[i].ent;
+    c->bytes -= ent->size;
+    c->hc--;
+    memmove(c->hv + i, c->hv + i + 1, (c->hc - i) * sizeof c->hv[0]);
+    memmove(c->ev + i, c->ev + i + 1, (c->hc - i) * sizeof c->ev[0]);
+    free(ent);
+}
+
+static void cache_init(struct cache *c)
+{
+    while (c->hc)
+	cache_evict(c, c->hc - 1);
+    free(c->hv);
+    free(c->ev);
+    // the search reads past the sentinel
+    c->hv = xmalloc((CACHE_SIZE + 1 + 16) * sizeof c->hv[0]);
+    c->ev = xmalloc(CACHE_SIZE * sizeof c->ev[0]);
+}
+
+// GDSF victim: the entry with the lowest priority, which inflates L
+static int cache_victim(struct cache *c)
+{
+    if (!gdsf)
+	return c->hc - 1;
+    int k = 0;
+    for (int i = 1; i < c->hc; i++)
+	if (c->ev[i].pri < c->ev[k].pri)
+	    k = i;
+    c->L = c->ev[k].pri;
+    return k;
+}
+
+static inline float cache_pri(struct cache *c, struct cache_ent *ent, int freq)
+{
+    return c->L + (float) freq * COST(ent->n) / ent->size;
+}
+
 static int cache_decode(struct cache *c,
 			const char *str, int len,
-			unsigned fullhash,
+			unsigned fullhash, uint64_t key,
 			int n /* expected v[] size */,
+			int size,
 			const unsigned **pv)
 {
     int i;
     struct cache_ent *ent;
     uint16_t *hv = c->hv;
-    struct cache_ent **ev = c->ev;
+    struct cache_slot *ev = c->ev;
+    c->cost += COST(n);
     unsigned hash = hash16(str, len);
 #if defined(__SSE2__)
     __m128i xmm0 = _mm_set1_epi16(hash);
@@ -104,7 +171,7 @@ static int cache_decode(struct cache *c,
 	if (i == c->hc)
 	    break;
 	// Found an entry
-	ent = ev[i];
+	ent = ev[i].ent;
 	// Recheck the entry
 	if (len != ent->len || fullhash != ent->fullhash) {
 	    hp++;
@@ -112,47 +179,217 @@ static int cache_decode(struct cache *c,
 	}
 	// Hit, move to front
 	c->hit++;
+	c->hitcost += COST(ent->n);
+	struct cache_slot slot = ev[i];
+	slot.freq++;
+	slot.pri = cache_pri(c, ent, slot.freq);
 	if (i > MOVSTEP) {
 	    hv += (unsigned) i - MOVSTEP;
 	    ev += (unsigned) i - MOVSTEP;
 	    memmove(hv + 1, hv, MOVSTEP * sizeof hv[0]);
 	    memmove(ev + 1, ev, MOVSTEP * sizeof ev[0]);
 	    hv[0] = hash;
-	    ev[0] = ent;
+	    i = 0;
 	}
+	ev[i] = slot;
 	*pv = NULL;
 	return ent->n;
     }
     // decode
     ent = xmalloc(sizeof(*ent));
     ent->fullhash = fullhash;
+    ent->key = key;
     ent->len = len;
     ent->n = n;
+    ent->size = size;
     c->miss++;
+    // make room
+    while (c->hc == CACHE_SIZE || (c->hc && c->bytes + size > budget))
+	cache_evict(c, cache_victim(c));
+    c->bytes += size;
     // insert
     if (c->hc <= MIDPOINT)
 	i = c->hc++;
     else {
-	// free last entry
-	if (c->hc < CACHE_SIZE)
-	    c->hc++;
-	else
-	    free(ev[CACHE_SIZE - 1]);
+	c->hc++;
 	// position at the midpoint
 	i = MIDPOINT;
-	memmove(hv + i + 1, hv + i, (CACHE_SIZE - i - 1) * sizeof hv[0]);
-	memmove(ev + i + 1, ev + i, (CACHE_SIZE - i - 1) * sizeof ev[0]);
+	memmove(hv + i + 1, hv + i, (c->hc - i - 1) * sizeof hv[0]);
+	memmove(ev + i + 1, ev + i, (c->hc - i - 1) * sizeof ev[0]);
     }
     hv[i] = hash;
-    ev[i] = ent;
+    ev[i] = (struct cache_slot) { ent, cache_pri(c, ent, 1), 1 };
     *pv = NULL;
     return n;
 }
 
+// the alternative index: an open-addressed table over the full 64-bit
+// hash, with the recency list threaded through ev[], split at the midpoint
+struct hslot {
+    uint32_t tag;
+    int i; // plus one
+};
+
+struct hent {
+    struct cache_ent *ent;
+    int prev, next;
+    bool prob;
+};
+
+struct hcache {
+    struct hslot *ix;
+    size_t mask;
+    struct hent *ev;
+    int hc;
+    int head, mid, nhead;
+    int hit, miss;
+};
+
+static inline void hlink(struct hent *ev, int i, int j)
+{
+    int k = ev[j].prev;
+    ev[i].prev = k;
+    ev[i].next = j;
+    ev[k].next = i;
+    ev[j].prev = i;
+}
+
+static inline void hunlink(struct hent *ev, int i)
+{
+    ev[ev[i].prev].next = ev[i].next;
+    ev[ev[i].next].prev = ev[i].prev;
+}
+
+static size_t hfind(struct hcache *c, uint64_t key, int i)
+{
+    size_t p = key & c->mask;
+    while (c->ix[p].i != i + 1)
+	p = (p + 1) & c->mask;
+    return p;
+}
+
+// evict the last entry of the list
+static void hcache_evict(struct hcache *c)
+{
+    struct hent *ev = c->ev;
+    int i = ev[c->head].prev;
+    struct cache_ent *ent = ev[i].ent;
+    // delete with backward shift
+    size_t p = hfind(c, ent->key, i);
+    for (size_t q = (p + 1) & c->mask; c->ix[q].i; q = (q + 1) & c->mask) {
+	size_t home = c->ix[q].tag & c->mask;
+	if (((q - home) & c->mask) >= ((q - p) & c->mask)) {
+	    c->ix[p] = c->ix[q];
+	    p = q;
+	}
+    }
+    c->ix[p].i = 0;
+    if (!ev[i].prob)
+	c->nhead--;
+    else if (i == c->mid)
+	c->mid = ev[i].next;
+    if (i == c->head)
+	c->head = ev[i].next;
+    hunlink(ev, i);
+    int last = --c->hc;
+    if (i < last) {
+	c->ix[hfind(c, ev[last].ent->key, last)].i = i + 1;
+	ev[i] = ev[last];
+	if (ev[i].next == last)
+	    ev[i].prev = ev[i].next = i;
+	else {
+	    ev[ev[i].prev].next = i;
+	    ev[ev[i].next].prev = i;
+	}
+	if (c->head == last)
+	    c->head = i;
+	if (c->mid == last)
+	    c->mid = i;
+    }
+    free(ent);
+}
+
+static void hcache_init(struct hcache *c)
+{
+    while (c->hc)
+	hcache_evict(c);
+    free(c->ix);
+    free(c->ev);
+    c->mask = 1;
+    while (c->mask < 2 * (size_t) CACHE_SIZE)
+	c->mask = 2 * c->mask + 1;
+    c->ix = calloc(c->mask + 1, sizeof c->ix[0]);
+    c->ev = xmalloc(CACHE_SIZE * sizeof c->ev[0]);
+    c->hc = c->nhead = 0;
+}
+
+static int hcache_decode(struct hcache *c, int len, uint64_t key, int n)
+{
+    struct hent *ev = c->ev;
+    int i;
+    for (size_t p = key & c->mask; (i = c->ix[p].i); p = (p + 1) & c->mask) {
+	if (c->ix[p].tag != (uint32_t) key)
+	    continue;
+	struct cache_ent *ent = ev[--i].ent;
+	if (ent->key != key || ent->len != len)
+	    continue;
+	// hit, move to front
+	c->hit++;
+	if (ev[i].prob) {
+	    ev[i].prob = 0;
+	    if (i == c->mid)
+		c->mid = ev[i].next;
+	    c->nhead++;
+	}
+	if (i != c->head) {
+	    hunlink(ev, i);
+	    hlink(ev, i, c->head);
+	    c->head = i;
+	}
+	if (c->nhead > MIDPOINT) {
+	    int j = ev[c->nhead == c->hc ? c->head : c->mid].prev;
+	    ev[j].prob = 1;
+	    c->mid = j;
+	    c->nhead--;
+	}
+	return ent->n;
+    }
+    // decode
+    struct cache_ent *ent = xmalloc(sizeof(*ent));
+    ent->key = key;
+    ent->len = len;
+    ent->n = n;
+    c->miss++;
+    if (c->hc == CACHE_SIZE)
+	hcache_evict(c);
+    // insert at the front of the tail segment
+    i = c->hc;
+    ev[i] = (struct hent) { ent, i, i, 1 };
+    if (c->hc)
+	hlink(ev, i, c->nhead < c->hc ? c->mid : c->head);
+    if (c->nhead == 0)
+	c->head = i;
+    c->mid = i;
+    c->hc++;
+    size_t p = key & c->mask;
+    while (c->ix[p].i)
+	p = (p + 1) & c->mask;
+    c->ix[p] = (struct hslot) { key, i + 1 };
+    return n;
+}
+
 struct line {
-    char str[4];
+    // hash16 reads str[4..7]
+    char str[8];
     int len;
     unsigned fullhash;
+    uint64_t key;
+    // the number of the distinct string
+    int id;
+    // approximate number of values, at about 2 characters per value
+    int n;
+    // approximate size of the cache entry
+    int size;
 };
 
 #define MAXLINES (1<<20)
@@ -174,16 +411,32 @@ static unsigned int jhash(const char *str)
     return hash;
 }
 
-#include <stdbool.h>
+static uint64_t hash64(const char *str, size_t len)
+{
+    uint64_t h = len * 0x9E3779B97F4A7C15ULL;
+    uint64_t x;
+    for (; len >= 8; str += 8, len -= 8) {
+	memcpy(&x, str, 8);
+	h = (h ^ x) * 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 32;
+    }
+    x = 0;
+    memcpy(&x, str, len);
+    h = (h ^ x) * 0xFF51AFD7ED558CCDULL;
+    return h ^ (h >> 29);
+}
 
 static bool doline(const char *line, size_t len)
 {
     if (len < 512) // approximates DECODE_CACHE_SIZE = 256
 	return 0;
-    unsigned hash = jhash(line);
-    char s[4];
-    strncpy(s, line, 4);
-    lines[nlines++] = (struct line) { { s[0], s[1], s[2], s[3] }, len, hash };
+    struct line *l = &lines[nlines++];
+    memcpy(l->str, line, 8);
+    l->len = len;
+    l->fullhash = jhash(line);
+    l->key = hash64(line, len);
+    l->n = len / 2;
+    l->size = 16 + len + (l->n + 4) * 4;
     return nlines == MAXLINES;
 }
 
@@ -206,25 +459,637 @@ static void readlines(void)
 }
 
 static struct cache C;
+static struct hcache H;
 static volatile unsigned ret;
 
 static void lru(void)
 {
-    C.hc = C.hit = C.miss = 0;
+    while (C.hc)
+	cache_evict(&C, C.hc - 1);
+    C.hit = C.miss = 0;
+    C.hitcost = C.cost = 0;
+    C.L = 0;
     for (int i = 0; i < nlines; i++) {
 	struct line *l = lines + i;
 	const unsigned *v;
-	int n = cache_decode(&C, l->str, l->len, l->fullhash, 3, &v);
+	int n = cache_decode(&C, l->str, l->len, l->fullhash, l->key,
+			     l->n, l->size, &v);
 	ret += n;
     }
 }
 
+static void hashed(void)
+{
+    while (H.hc)
+	hcache_evict(&H);
+    H.hit = H.miss = 0;
+    for (int i = 0; i < nlines; i++) {
+	struct line *l = lines + i;
+	ret += hcache_decode(&H, l->len, l->key, l->n);
+    }
+}
+
+// Replacement policies, replayed over the distinct strings numbered
+// 0..nids-1, counting entries rather than bytes.  Each string is on at
+// most one list at a time; the lists are circular, with sentinels after
+// the ids.
+static int nids;
+static uint64_t *idkey;
+
+static void number_lines(void)
+{
+    size_t mask = 1;
+    while (mask < 2 * (size_t) nlines)
+	mask = 2 * mask + 1;
+    int *ix = malloc((mask + 1) * sizeof ix[0]);
+    memset(ix, -1, (mask + 1) * sizeof ix[0]);
+    idkey = xmalloc(nlines * sizeof idkey[0]);
+    for (int i = 0; i < nlines; i++) {
+	struct line *l = lines + i;
+	size_t p = l->key & mask;
+	while (ix[p] >= 0 && idkey[ix[p]] != l->key)
+	    p = (p + 1) & mask;
+	if (ix[p] < 0) {
+	    idkey[nids] = l->key;
+	    ix[p] = nids++;
+	}
+	l->id = ix[p];
+    }
+    free(ix);
+}
+
+#define NLISTS 4
+static struct { int prev, next; } *lk;
+static signed char *where;
+static int lsize[NLISTS];
+#define SENT(l) (nids + (l))
+
+static void lists_init(void)
+{
+    lk = realloc(lk, (nids + NLISTS) * sizeof lk[0]);
+    where = realloc(where, nids);
+    memset(where, -1, nids);
+    for (int l = 0; l < NLISTS; l++) {
+	lk[SENT(l)].prev = lk[SENT(l)].next = SENT(l);
+	lsize[l] = 0;
+    }
+}
+
+// to the front, which is the most recently used end
+static void push(int l, int x)
+{
+    int s = SENT(l), y = lk[s].next;
+    lk[x].prev = s;
+    lk[x].next = y;
+    lk[s].next = lk[y].prev = x;
+    where[x] = l;
+    lsize[l]++;
+}
+
+static void unlink1(int x)
+{
+    lk[lk[x].prev].next = lk[x].next;
+    lk[lk[x].next].prev = lk[x].prev;
+    lsize[(int) where[x]]--;
+    where[x] = -1;
+}
+
+static int tail(int l)
+{
+    return lk[SENT(l)].prev;
+}
+
+static void move(int l, int x)
+{
+    unlink1(x);
+    push(l, x);
+}
+
+static int cap;
+
+// plain LRU, for reference
+static void lru_init(void)
+{
+    lists_init();
+}
+
+static bool lru_access(int x)
+{
+    if (where[x] == 0) {
+	move(0, x);
+	return 1;
+    }
+    if (lsize[0] == cap)
+	unlink1(tail(0));
+    push(0, x);
+    return 0;
+}
+
+// the cache as in rpmsetcmp.c, with the midpoint insertion
+static void midpoint_init(void)
+{
+    cache_size = cap;
+    cache_init(&C);
+    C.hit = C.miss = 0;
+    C.L = 0;
+}
+
+static bool midpoint_access(int x)
+{
+    struct line *l = lines + x;
+    const unsigned *v;
+    int hit = C.hit;
+    cache_decode(&C, l->str, l->len, l->fullhash, l->key, l->n, l->size, &v);
+    return C.hit > hit;
+}
+
+// 2Q [Johnson and Shasha 1994]: first-timers go to the A1in queue,
+// the ghosts of those evicted from A1in are remembered in A1out, and
+// a hit in A1out promotes to the main LRU list Am
+enum { AM, A1IN, A1OUT };
+
+static void twoq_init(void)
+{
+    lists_init();
+}
+
+static void twoq_reclaim(void)
+{
+    int kin = cap / 4, kout = cap / 2;
+    if (lsize[AM] + lsize[A1IN] < cap)
+	return;
+    if (lsize[A1IN] > kin || lsize[AM] == 0) {
+	move(A1OUT, tail(A1IN));
+	if (lsize[A1OUT] > kout)
+	    unlink1(tail(A1OUT));
+    }
+    else
+	unlink1(tail(AM));
+}
+
+static bool twoq_access(int x)
+{
+    switch (where[x]) {
+    case AM:
+	move(AM, x);
+	return 1;
+    case A1IN:
+	return 1;
+    case A1OUT:
+	unlink1(x);
+	twoq_reclaim();
+	push(AM, x);
+	return 0;
+    }
+    twoq_reclaim();
+    push(A1IN, x);
+    return 0;
+}
+
+// ARC [Megiddo and Modha 2003]: T1 and T2 are the recent and frequent
+// entries, B1 and B2 their ghosts, p is the adaptive target size of T1
+enum { T1, T2, B1, B2 };
+static int arcp;
+
+static void arc_init(void)
+{
+    lists_init();
+    arcp = 0;
+}
+
+static void arc_replace(bool inb2)
+{
+    if (lsize[T1] && (lsize[T1] > arcp || (inb2 && lsize[T1] == arcp)))
+	move(B1, tail(T1));
+    else
+	move(B2, tail(T2));
+}
+
+static bool arc_access(int x)
+{
+    int d;
+    switch (where[x]) {
+    case T1:
+    case T2:
+	move(T2, x);
+	return 1;
+    case B1:
+	d = lsize[B2] > lsize[B1] ? lsize[B2] / lsize[B1] : 1;
+	arcp = arcp + d < cap ? arcp + d : cap;
+	arc_replace(0);
+	move(T2, x);
+	return 0;
+    case B2:
+	d = lsize[B1] > lsize[B2] ? lsize[B1] / lsize[B2] : 1;
+	arcp = arcp - d > 0 ? arcp - d : 0;
+	arc_replace(1);
+	move(T2, x);
+	return 0;
+    }
+    int l1 = lsize[T1] + lsize[B1];
+    int all = l1 + lsize[T2] + lsize[B2];
+    if (l1 == cap) {
+	if (lsize[T1] < cap) {
+	    unlink1(tail(B1));
+	    arc_replace(0);
+	}
+	else
+	    unlink1(tail(T1));
+    }
+    else if (all >= cap) {
+	if (all == 2 * cap)
+	    unlink1(tail(B2));
+	arc_replace(0);
+    }
+    push(T1, x);
+    return 0;
+}
+
+// W-TinyLFU [Einziger et al. 2017]: a small LRU window in front of
+// the segmented LRU main cache; the window's victim is admitted into
+// the main cache only if it is more frequent than the main's victim,
+// per the count-min sketch of 4-bit counters, which are halved when
+// the sample is full
+enum { WINDOW, PROBATION, PROTECTED };
+static uint8_t *sketch;
+static size_t smask;
+static int samples;
+
+static void tlfu_init(void)
+{
+    lists_init();
+    smask = 15;
+    while (smask < 4 * (size_t) cap)
+	smask = 2 * smask + 1;
+    free(sketch);
+    sketch = calloc(4, smask + 1);
+    samples = 0;
+}
+
+static inline size_t sketch_ix(int x, int r)
+{
+    uint64_t h = (idkey[x] + r) * 0x9E3779B97F4A7C15ULL;
+    return r * (smask + 1) + ((h >> 32) & smask);
+}
+
+static int sketch_freq(int x)
+{
+    int f = 15;
+    for (int r = 0; r < 4; r++)
+	if (sketch[sketch_ix(x, r)] < f)
+	    f = sketch[sketch_ix(x, r)];
+    return f;
+}
+
+static void sketch_inc(int x)
+{
+    for (int r = 0; r < 4; r++) {
+	uint8_t *c = &sketch[sketch_ix(x, r)];
+	if (*c < 15)
+	    ++*c;
+    }
+    if (++samples == 10 * cap) {
+	for (size_t i = 0; i < 4 * (smask + 1); i++)
+	    sketch[i] /= 2;
+	samples /= 2;
+    }
+}
+
+static bool tlfu_access(int x)
+{
+    int wmax = cap / 100 > 1 ? cap / 100 : 1;
+    int mmax = cap - wmax;
+    int pmax = mmax * 8 / 10;
+    sketch_inc(x);
+    switch (where[x]) {
+    case WINDOW:
+    case PROTECTED:
+	move(where[x], x);
+	return 1;
+    case PROBATION:
+	move(PROTECTED, x);
+	if (lsize[PROTECTED] > pmax)
+	    move(PROBATION, tail(PROTECTED));
+	return 1;
+    }
+    push(WINDOW, x);
+    if (lsize[WINDOW] <= wmax)
+	return 0;
+    int cand = tail(WINDOW);
+    unlink1(cand);
+    if (lsize[PROBATION] + lsize[PROTECTED] < mmax) {
+	push(PROBATION, cand);
+	return 0;
+    }
+    int victim = tail(lsize[PROBATION] ? PROBATION : PROTECTED);
+    if (sketch_freq(cand) > sketch_freq(victim)) {
+	unlink1(victim);
+	push(PROBATION, cand);
+    }
+    return 0;
+}
+
+// CLOCK-Pro [Jiang et al. 2005]: resident entries are hot or cold,
+// and the evicted cold entries stay as non-resident test entries;
+// a hit on a test entry makes it hot and grows the cold target.
+// The three hands run over a single ring, new entries are added
+// behind the hot hand.
+enum { CP_NONE, CP_HOT, CP_COLD, CP_TEST };
+static struct { int prev, next; } *ring;
+static char *cptype, *cpref;
+static int hand_hot, hand_cold, hand_test;
+static int mem_cold, count_hot, count_cold, count_test;
+
+static void cp_run_cold(void);
+static void cp_run_test(void);
+
+static void cp_del(int x)
+{
+    if (ring[x].next == x)
+	hand_hot = hand_cold = hand_test = -1;
+    else {
+	if (x == hand_hot)
+	    hand_hot = ring[x].prev;
+	if (x == hand_cold)
+	    hand_cold = ring[x].prev;
+	if (x == hand_test)
+	    hand_test = ring[x].prev;
+	ring[ring[x].prev].next = ring[x].next;
+	ring[ring[x].next].prev = ring[x].prev;
+    }
+}
+
+static void cp_run_hot(void)
+{
+    if (hand_hot == hand_test)
+	cp_run_test();
+    int x = hand_hot;
+    if (cptype[x] == CP_HOT) {
+	if (cpref[x])
+	    cpref[x] = 0;
+	else {
+	    cptype[x] = CP_COLD;
+	    count_hot--;
+	    count_cold++;
+	}
+    }
+    hand_hot = ring[hand_hot].next;
+}
+
+static void cp_run_test(void)
+{
+    if (hand_test == hand_cold)
+	cp_run_cold();
+    int x = hand_test;
+    if (cptype[x] == CP_TEST) {
+	int prev = ring[x].prev;
+	cp_del(x);
+	cptype[x] = CP_NONE;
+	hand_test = prev;
+	count_test--;
+	if (mem_cold > 1)
+	    mem_cold--;
+    }
+    hand_test = ring[hand_test].next;
+}
+
+static void cp_run_cold(void)
+{
+    int x = hand_cold;
+    if (cptype[x] == CP_COLD) {
+	if (cpref[x]) {
+	    cptype[x] = CP_HOT;
+	    cpref[x] = 0;
+	    count_cold--;
+	    count_hot++;
+	}
+	else {
+	    cptype[x] = CP_TEST;
+	    count_cold--;
+	    count_test++;
+	    while (cap < count_test)
+		cp_run_test();
+	}
+    }
+    hand_cold = ring[hand_cold].next;
+    while (cap - mem_cold < count_hot)
+	cp_run_hot();
+}
+
+static void cp_add(int x)
+{
+    while (cap <= count_hot + count_cold)
+	cp_run_cold();
+    if (hand_hot < 0) {
+	ring[x].prev = ring[x].next = x;
+	hand_hot = hand_cold = hand_test = x;
+    }
+    else {
+	// link behind the hot hand
+	int y = hand_hot, z = ring[y].prev;
+	ring[x].prev = z;
+	ring[x].next = y;
+	ring[z].next = ring[y].prev = x;
+    }
+    if (hand_cold == hand_hot)
+	hand_cold = ring[hand_cold].next;
+    if (hand_test == hand_hot)
+	hand_test = ring[hand_test].next;
+}
+
+static void clockpro_init(void)
+{
+    ring = realloc(ring, nids * sizeof ring[0]);
+    free(cptype);
+    free(cpref);
+    cptype = calloc(nids, 1);
+    cpref = calloc(nids, 1);
+    hand_hot = hand_cold = hand_test = -1;
+    mem_cold = cap;
+    count_hot = count_cold = count_test = 0;
+}
+
+static bool clockpro_access(int x)
+{
+    switch (cptype[x]) {
+    case CP_HOT:
+    case CP_COLD:
+	cpref[x] = 1;
+	return 1;
+    case CP_TEST:
+	if (mem_cold < cap)
+	    mem_cold++;
+	cp_del(x);
+	count_test--;
+	cptype[x] = CP_HOT;
+	cpref[x] = 0;
+	cp_add(x);
+	count_hot++;
+	return 0;
+    }
+    cptype[x] = CP_COLD;
+    cpref[x] = 0;
+    cp_add(x);
+    count_cold++;
+    return 0;
+}
+
+// Belady's MIN, which evicts the entry next used the farthest in
+// the future (possibly the new one), is the upper bound
+static int *nextuse;
+
+static void number_uses(void)
+{
+    nextuse = xmalloc(nlines * sizeof nextuse[0]);
+    int *last = xmalloc(nids * sizeof last[0]);
+    for (int x = 0; x < nids; x++)
+	last[x] = INT_MAX;
+    for (int i = nlines - 1; i >= 0; i--) {
+	nextuse[i] = last[lines[i].id];
+	last[lines[i].id] = i;
+    }
+    free(last);
+}
+
+// max-heap of (next use, id), with stale elements skipped
+struct use {
+    int when;
+    int x;
+};
+static struct use *heap;
+static int hn;
+static int *resnext; // the next use of a resident entry, or -1
+
+static void heap_push(struct use u)
+{
+    int i = hn++;
+    while (i && heap[(i - 1) / 2].when < u.when) {
+	heap[i] = heap[(i - 1) / 2];
+	i = (i - 1) / 2;
+    }
+    heap[i] = u;
+}
+
+static struct use heap_pop(void)
+{
+    struct use top = heap[0], u = heap[--hn];
+    int i = 0;
+    while (2 * i + 1 < hn) {
+	int j = 2 * i + 1;
+	if (j + 1 < hn && heap[j + 1].when > heap[j].when)
+	    j++;
+	if (heap[j].when <= u.when)
+	    break;
+	heap[i] = heap[j];
+	i = j;
+    }
+    heap[i] = u;
+    return top;
+}
+
+static int nres;
+
+static void min_init(void)
+{
+    heap = realloc(heap, nlines * sizeof heap[0]);
+    hn = 0;
+    free(resnext);
+    resnext = xmalloc(nids * sizeof resnext[0]);
+    memset(resnext, -1, nids * sizeof resnext[0]);
+    nres = 0;
+}
+
+// MIN needs the position in the trace, rather than the id
+static bool min_access(int i)
+{
+    int x = lines[i].id;
+    bool hit = resnext[x] >= 0;
+    if (!hit)
+	nres++;
+    resnext[x] = nextuse[i];
+    heap_push((struct use) { nextuse[i], x });
+    while (nres > cap) {
+	struct use u = heap_pop();
+	if (resnext[u.x] == u.when) {
+	    resnext[u.x] = -1;
+	    nres--;
+	}
+    }
+    return hit;
+}
+
+struct policy {
+    const char *name;
+    void (*init)(void);
+    bool (*access)(int x);
+    bool byline;
+};
+
+static const struct policy policies[] = {
+    { "lru", lru_init, lru_access, 0 },
+    { "midpoint", midpoint_init, midpoint_access, 1 },
+    { "2q", twoq_init, twoq_access, 0 },
+    { "arc", arc_init, arc_access, 0 },
+    { "w-tinylfu", tlfu_init, tlfu_access, 0 },
+    { "clock-pro", clockpro_init, clockpro_access, 0 },
+    { "min", min_init, min_access, 1 },
+};
+
+static double replay(const struct policy *p)
+{
+    int hit = 0;
+    p->init();
+    for (int i = 0; i < nlines; i++)
+	hit += p->access(p->byline ? i : lines[i].id);
+    return 100.0 * hit / nlines;
+}
+
 #include "bench.h"
 
 int main()
 {
     readlines();
-    BENCH(lru);
-    printf("%.2f%% hit ratio\n", 100.0 * C.hit / (C.hit + C.miss));
+    // the fixed number of entries, as before
+    budget = SIZE_MAX;
+    // linear search vs hash table, as the cache grows
+    static const int sizes[] = { 256, 1024, 8192 };
+    for (int k = 0; k < 3; k++) {
+	cache_size = sizes[k] - 1;
+	char name[2][32];
+	snprintf(name[0], sizeof name[0], "lru%d", cache_size + 1);
+	snprintf(name[1], sizeof name[1], "hashed%d", cache_size + 1);
+	cache_init(&C);
+	hcache_init(&H);
+	bench(lru, name[0]);
+	printf("%.2f%% hit ratio\n", 100.0 * C.hit / (C.hit + C.miss));
+	bench(hashed, name[1]);
+	printf("%.2f%% hit ratio\n", 100.0 * H.hit / (H.hit + H.miss));
+    }
+    cache_size = 256 - 1;
+    cache_init(&C);
+    // limited by memory, LRU vs GDSF
+    for (budget = 1 << 20; budget <= 16 << 20; budget *= 2)
+	for (gdsf = 0; gdsf <= 1; gdsf++) {
+	    lru();
+	    printf("%2zuM %s %.2f%% hit ratio, %.2f%% decode cost saved\n",
+		   budget >> 20, gdsf ? "gdsf" : "lru ",
+		   100.0 * C.hit / (C.hit + C.miss),
+		   100.0 * C.hitcost / C.cost);
+	}
+    // replacement policies, by the number of entries
+    budget = SIZE_MAX;
+    gdsf = 0;
+    number_lines();
+    number_uses();
+    printf("%-10s", "entries");
+    for (cap = 64; cap <= 1024; cap *= 2)
+	printf("%8d", cap);
+    printf("\n");
+    for (size_t k = 0; k < sizeof policies / sizeof policies[0]; k++) {
+	printf("%-10s", policies[k].name);
+	for (cap = 64; cap <= 1024; cap *= 2)
+	    printf("%7.2f%%", replay(&policies[k]));
+	printf("\n");
+    }
     return 0;
 }
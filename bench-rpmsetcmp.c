@@ -1,6 +1,9 @@
+#include <stddef.h>
+
 struct two {
     const char *s1;
     const char *s2;
+    size_t len1, len2;
 };
 
 #define MAXTWOS (1<<20)
@@ -14,7 +17,7 @@ static void dotwo(const char *s1, const char *s2)
 {
     if (strncmp(s1, "set:", 4) == 0) s1 += 4;
     if (strncmp(s2, "set:", 4) == 0) s2 += 4;
-    twos[ntwos++] = (struct two) { s1, s2 };
+    twos[ntwos++] = (struct two) { s1, s2, strlen(s1), strlen(s2) };
     assert(ntwos <= MAXTWOS);
 }
 
@@ -40,6 +43,35 @@ static void readlines(void)
     }
 }
 
+// apt passes the same pointer for the same Provides
+static struct two same[MAXTWOS];
+
+#include <stdlib.h>
+
+static int cmpidx(const void *a, const void *b)
+{
+    int i = *(const int *) a, j = *(const int *) b;
+    int cmp = strcmp(twos[i].s1, twos[j].s1);
+    return cmp ? cmp : i - j;
+}
+
+static void intern(void)
+{
+    int *idx = malloc(ntwos * sizeof idx[0]);
+    for (int i = 0; i < ntwos; i++)
+	idx[i] = i;
+    qsort(idx, ntwos, sizeof idx[0], cmpidx);
+    const char *s1 = NULL;
+    for (int k = 0; k < ntwos; k++) {
+	int i = idx[k];
+	if (s1 == NULL || strcmp(s1, twos[i].s1))
+	    s1 = twos[i].s1;
+	same[i] = twos[i];
+	same[i].s1 = s1;
+    }
+    free(idx);
+}
+
 #include "rpmsetcmp.h"
 
 static void setcmp(void)
@@ -51,11 +83,199 @@ static void setcmp(void)
     }
 }
 
+// the lengths are known
+static void setcmpN(void)
+{
+    for (int i = 0; i < ntwos; i++) {
+	struct two *two = twos + i;
+	int ret = rpmsetcmpN(two->s1, two->len1, two->s2, two->len2);
+	assert(ret >= -2);
+    }
+}
+
+static void setcmp_same(void)
+{
+    for (int i = 0; i < ntwos; i++) {
+	struct two *two = same + i;
+	int ret = rpmsetcmp(two->s1, two->s2);
+	assert(ret >= -2);
+    }
+}
+
+static void immutable(void)
+{
+    rpmsetcmpCtxImmutable(NULL, 1);
+    setcmp_same();
+    rpmsetcmpCtxImmutable(NULL, 0);
+}
+
+static void memo(void)
+{
+    rpmsetcmpCtxMemo(NULL, 1 << 16);
+    setcmp();
+    rpmsetcmpCtxMemo(NULL, 0);
+}
+
+static void satisfies(void)
+{
+    for (int i = 0; i < ntwos; i++) {
+	struct two *two = twos + i;
+	int ret = rpmsetSatisfies(two->s1, two->s2);
+	assert(ret >= 0);
+    }
+}
+
+static void detail(void)
+{
+    for (int i = 0; i < ntwos; i++) {
+	struct two *two = twos + i;
+	struct rpmsetcmpCounts cnt;
+	int ret = rpmsetcmpDetail(two->s1, two->s2, &cnt);
+	assert(ret >= -3);
+    }
+}
+
+// cache misses, with the entries evicted by size
+static void churn(void)
+{
+    struct rpmsetcmpCtx *ctx = rpmsetcmpCtxNew();
+    rpmsetcmpCtxBudget(ctx, 2 << 20);
+    for (int i = 0; i < ntwos; i++) {
+	struct two *two = twos + i;
+	int ret = rpmsetcmpCtx(ctx, two->s1, two->s2);
+	assert(ret >= -2);
+    }
+    rpmsetcmpCtxFree(ctx);
+}
+
+// the sets decoded by the caller
+static struct rpmsetHandle *handles[MAXTWOS][2];
+
+static void decode_handles(void)
+{
+    for (int i = 0; i < ntwos; i++) {
+	handles[i][0] = rpmsetDecodeHandle(twos[i].s1);
+	handles[i][1] = rpmsetDecodeHandle(twos[i].s2);
+    }
+}
+
+static void cmp_handles(void)
+{
+    for (int i = 0; i < ntwos; i++) {
+	int ret = rpmsetcmpHandles(handles[i][0], handles[i][1]);
+	assert(ret >= -2);
+    }
+}
+
+// all Provides decoded up front
+static const char *sv[MAXTWOS];
+
+static void preload(void)
+{
+    int ret = rpmsetPreload(sv, ntwos);
+    assert(ret >= 0);
+}
+
+// apt walks the packages, and does some work of its own between the
+// comparisons; the next Provides can be prefetched meanwhile
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define LOOKAHEAD 4
+
+static void apt1(bool prefetch)
+{
+    // each run in a new process, so that the caches are cold
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid) {
+	waitpid(pid, NULL, 0);
+	return;
+    }
+    for (int i = 0; i < ntwos; i++) {
+	struct two *two = twos + i;
+	if (prefetch && i + LOOKAHEAD < ntwos)
+	    rpmsetcmpPrefetch(two[LOOKAHEAD].s1);
+	for (volatile int k = 0; k < 1000; k++)
+	    ;
+	int ret = rpmsetcmp(two->s1, two->s2);
+	assert(ret >= -2);
+    }
+    _exit(0);
+}
+
+static void apt(void)
+{
+    apt1(0);
+}
+
+static void apt_prefetch(void)
+{
+    apt1(1);
+}
+
+#include <pthread.h>
+
+// throughput, each thread with its own context and share of pairs
+static int nthreads;
+
+static void *worker(void *arg)
+{
+    long t = (long) arg;
+    int begin = ntwos * t / nthreads;
+    int end = ntwos * (t + 1) / nthreads;
+    struct rpmsetcmpCtx *ctx = rpmsetcmpCtxNew();
+    for (int i = begin; i < end; i++) {
+	struct two *two = twos + i;
+	int ret = rpmsetcmpCtx(ctx, two->s1, two->s2);
+	assert(ret >= -2);
+    }
+    rpmsetcmpCtxFree(ctx);
+    return NULL;
+}
+
+static void threads(void)
+{
+    pthread_t tid[nthreads];
+    for (long t = 0; t < nthreads; t++)
+	pthread_create(&tid[t], NULL, worker, (void *) t);
+    for (int t = 0; t < nthreads; t++)
+	pthread_join(tid[t], NULL);
+}
+
 #include "bench.h"
 
 int main()
 {
     readlines();
+    intern();
+    // before the caches are warmed up
+    BENCH(apt);
+    BENCH(apt_prefetch);
     BENCH(setcmp);
+    BENCH(setcmpN);
+    BENCH(setcmp_same);
+    BENCH(immutable);
+    BENCH(memo);
+    BENCH(satisfies);
+    BENCH(detail);
+    BENCH(churn);
+    decode_handles();
+    BENCH(cmp_handles);
+    for (int i = 0; i < ntwos; i++) {
+	rpmsetHandleFree(handles[i][0]);
+	rpmsetHandleFree(handles[i][1]);
+    }
+    for (int i = 0; i < ntwos; i++)
+	sv[i] = twos[i].s1;
+    BENCH(preload);
+    bench(setcmp, "preloaded");
+    rpmsetPreload(NULL, 0);
+    for (nthreads = 1; nthreads <= 64; nthreads *= 2) {
+	char name[32];
+	snprintf(name, sizeof name, "threads%d", nthreads);
+	bench(threads, name);
+    }
     return 0;
 }
@@ -87,11 +87,21 @@ static void setcmpall(void)
     }
 }
 
+static void nosentinels(void)
+{
+    for (int i = 0; i < ntwos; i++) {
+	struct two *two = twos + i;
+	int ret = setcmp_nosentinels(two->v1, two->n1, two->v2, two->n2);
+	assert(ret != 42);
+    }
+}
+
 #include "bench.h"
 
 int main()
 {
     readlines();
     BENCH(setcmpall);
+    BENCH(nosentinels);
     return 0;
 }
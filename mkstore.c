@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "rpmsetcmp.h"
+
+/* Read set-versions, one per line, and write their decoded store.
+ * With setcmp input, only the first set on each line (Provides) is taken. */
+int main(int argc, const char **argv)
+{
+    assert(argc == 2);
+    const char **sv = NULL;
+    int n = 0, alloc_n = 0;
+    char *line = NULL;
+    size_t alloc_size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &alloc_size, stdin)) >= 0) {
+	if (len > 0 && line[len-1] == '\n')
+	    line[--len] = '\0';
+	if (len == 0)
+	    continue;
+	line[strcspn(line, " \t")] = '\0';
+	if (n == alloc_n) {
+	    alloc_n = alloc_n ? 2 * alloc_n : 1024;
+	    sv = realloc(sv, alloc_n * sizeof sv[0]);
+	    assert(sv);
+	}
+	sv[n++] = strncmp(line, "set:", 4) == 0 ? line + 4 : line;
+	line = NULL;
+	alloc_size = 0;
+    }
+    free(line);
+    if (rpmsetcmpStoreBuild(argv[1], sv, n)) {
+	perror(argv[1]);
+	return 1;
+    }
+    return 0;
+}
+
+/* ex: set ts=8 sts=4 sw=4 noet: */
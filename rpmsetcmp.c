@@ -95,14 +95,16 @@ static int setcmp(const unsigned *v1, size_t n1,
 	v1 += 4*N;		\
     }
     /* We're now able to provide a reference implementation for IFLT
-     * and IFGE, thus completing the loop. */
+     * and IFGE, thus completing the loop.  Note that when IFLT runs
+     * off v1end, v2val is missing from v1, and so v1 is neither "less
+     * or equal" nor "greater or equal" than v2. */
 #define IFLT1(ADV)		\
     if (v1val < v2val) {	\
 	le = 0;			\
 	ADVANCE_V1_ ## ADV(1);	\
 	v1++;			\
 	if (v1 == v1end)	\
-	    return ge ? 1 : -2; \
+	    return -2;		\
 	v1val = *v1;		\
     }
 #define IFGE			\
@@ -137,7 +139,7 @@ static int setcmp(const unsigned *v1, size_t n1,
 	else			\
 	    v1--;		\
 	if (v1 == v1end)	\
-	    return ge ? 1 : -2; \
+	    return -2;		\
 	v1val = *v1;		\
     }
 #define IFLT4(ADV)		\
@@ -152,7 +154,7 @@ static int setcmp(const unsigned *v1, size_t n1,
 	if (*v1 < v2val)	\
 	    v1++;		\
 	if (v1 == v1end)	\
-	    return ge ? 1 : -2; \
+	    return -2;		\
 	v1val = *v1;		\
     }
 #define IFLT8(ADV)		\
@@ -171,7 +173,7 @@ static int setcmp(const unsigned *v1, size_t n1,
 	if (*v1 < v2val)	\
 	    v1++;		\
 	if (v1 == v1end)	\
-	    return ge ? 1 : -2; \
+	    return -2;		\
 	v1val = *v1;		\
     }
     /* Choose the right loop:
@@ -207,6 +209,61 @@ static int setcmp(const unsigned *v1, size_t n1,
     return -2;
 }
 
+/*
+ * Most of the time, the caller only wants to know whether Requires are
+ * satisfied, i.e. whether v2 is a subset of v1.  In this case, there is
+ * no need to finish the merge to clear the "le" flag: the loop can stop
+ * at the very first element of v2 which is missing from v1.  Also, since
+ * unmet dependencies tend to be detected at the end of v2, a few simple
+ * checks can reject the subset relation before the loop runs.
+ */
+static int setsubset(const unsigned *v1, size_t n1,
+		     const unsigned *v2, size_t n2)
+{
+    if (n2 > n1)
+	return 0;
+    if (v2[0] < v1[0])
+	return 0;
+    if (v2[n2-1] > v1[n1-1])
+	return 0;
+    /* Since the last element of v1 is no less than any element of v2,
+     * the IFLT part never runs off v1end; le is only there to make
+     * it compile. */
+    bool le = 1;
+    (void) le;
+    const unsigned *v1end = v1 + n1;
+    const unsigned *v2end = v2 + n2;
+    unsigned v1val = *v1;
+    unsigned v2val = *v2;
+    /* The "IFEQ" part replaces IFGE: a mismatch is final. */
+#define IFEQ			\
+    if (v1val == v2val) {	\
+	v1++, v2++;		\
+	if (v2 == v2end)	\
+	    return 1;		\
+	if (v1 == v1end)	\
+	    return 0;		\
+	v1val = *v1;		\
+	v2val = *v2;		\
+    }				\
+    else			\
+	return 0;
+#define SUBLOOP(N, ADV)		\
+    do {			\
+	while (1) {		\
+	    IFLT ## N(ADV);	\
+	    IFEQ;		\
+	}			\
+    } while (0)
+    bool smallstep = CROSSOVER > 32 && sizeof n2 < 5 ?
+	    n1 / 2 < CROSSOVER / 2 * n2 :
+	    n1 / 1 < CROSSOVER / 1 * n2 ;
+    if (smallstep)
+	SUBLOOP(2, UNROLLED);
+    else
+	SUBLOOP(4, UNROLLED);
+}
+
 /* The above technique requires sentinels properly installed
  * at the end of every Provides set. */
 static inline void install_sentinels(unsigned *v, int n)
@@ -214,6 +271,299 @@ static inline void install_sentinels(unsigned *v, int n)
     memset(v + n, 0xff, SENTINELS * sizeof(*v));
 }
 
+/*
+ * Sentinels cannot be installed when v1[] lives in read-only memory
+ * (e.g. mmapped or shared), and copying the array just to make room
+ * for sentinels defeats the purpose.  However, the last SENTINELS elements
+ * of v1[] can serve as natural sentinels for the head of v2[], i.e. for
+ * the elements no greater than v1end[-SENTINELS]: the speculative loads
+ * in IFLT never go past an element that stops the loop.  The remaining
+ * tail of v2[] can only match the last few elements of v1[], and it is
+ * handled with a simple merge.
+ */
+static int setcmp_nosentinels(const unsigned *v1, size_t n1,
+			      const unsigned *v2, size_t n2)
+{
+    bool le = 1, ge = 1;
+    const unsigned *v1end = v1 + n1;
+    const unsigned *v2last = v2 + n2;
+    if (n1 > SENTINELS) {
+	/* Find the first element of v2 past the head. */
+	unsigned vmax = v1end[-SENTINELS];
+	size_t l = 0;
+	size_t u = n2;
+	while (l < u) {
+	    size_t i = (l + u) / 2;
+	    if (v2[i] <= vmax)
+		l = i + 1;
+	    else
+		u = i;
+	}
+	/* Run the usual loop over the head.  Note that IFLT never runs
+	 * off v1end, and IFGE breaks out at the end of the head. */
+	if (u > 0) {
+	    const unsigned *v2end = v2 + u;
+	    unsigned v1val = *v1;
+	    unsigned v2val = *v2;
+	    bool smallstep = CROSSOVER > 32 && sizeof u < 5 ?
+		    n1 / 2 < CROSSOVER / 2 * u :
+		    n1 / 1 < CROSSOVER / 1 * u ;
+	    if (smallstep)
+		CMPLOOP(2, UNROLLED);
+	    else
+		CMPLOOP(4, UNROLLED);
+	}
+	/* Elements of v1 before the natural sentinels are less than
+	 * any element in the tail of v2. */
+	if (v1 < v1end - SENTINELS) {
+	    le = 0;
+	    v1 = v1end - SENTINELS;
+	}
+    }
+    /* The tail. */
+    while (v1 < v1end && v2 < v2last) {
+	if (*v1 < *v2)
+	    le = 0, v1++;
+	else if (*v1 == *v2)
+	    v1++, v2++;
+	else
+	    ge = 0, v2++;
+    }
+    if (v1 < v1end)
+	le = 0;
+    if (v2 < v2last)
+	ge = 0;
+    if (le && ge)
+	return 0;
+    if (ge)
+	return 1;
+    if (le)
+	return -1;
+    return -2;
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Sometimes, the caller wants to know how much the sets differ, e.g.
+ * how many symbols are missing.  This takes the size of the intersection,
+ * and therefore a full merge.  Since there are no shortcuts anyway,
+ * the merge is done in blocks of 4 elements: each block of v1 is compared
+ * against all rotations of a block of v2, and the matches are counted
+ * with a popcount; then the block with the smaller last element advances
+ * (or both blocks, when the last elements are equal).  This way, each
+ * common element is counted exactly once, and the only branch that
+ * depends on the data is the one that chooses which block to advance.
+ * Cf. Schlegel et al., Fast Sorted-Set Intersection using SIMD Instructions.
+ */
+static size_t setcmp_common(const unsigned *v1, size_t n1,
+			    const unsigned *v2, size_t n2)
+{
+    size_t common = 0;
+    const unsigned *v1end = v1 + n1;
+    const unsigned *v2end = v2 + n2;
+#if defined(__SSE2__) || defined(__ARM_NEON) || defined(__aarch64__)
+    if (n1 >= 4 && n2 >= 4) {
+	const unsigned *v1last = v1end - 4;
+	const unsigned *v2last = v2end - 4;
+	while (1) {
+#if defined(__SSE2__)
+	    __m128i xmm1 = _mm_loadu_si128((void *) v1);
+	    __m128i xmm2 = _mm_loadu_si128((void *) v2);
+	    __m128i cmp0 = _mm_cmpeq_epi32(xmm1, xmm2);
+	    xmm2 = _mm_shuffle_epi32(xmm2, _MM_SHUFFLE(0, 3, 2, 1));
+	    __m128i cmp1 = _mm_cmpeq_epi32(xmm1, xmm2);
+	    xmm2 = _mm_shuffle_epi32(xmm2, _MM_SHUFFLE(0, 3, 2, 1));
+	    __m128i cmp2 = _mm_cmpeq_epi32(xmm1, xmm2);
+	    xmm2 = _mm_shuffle_epi32(xmm2, _MM_SHUFFLE(0, 3, 2, 1));
+	    __m128i cmp3 = _mm_cmpeq_epi32(xmm1, xmm2);
+	    cmp0 = _mm_or_si128(_mm_or_si128(cmp0, cmp1),
+				_mm_or_si128(cmp2, cmp3));
+	    common += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(cmp0)));
+#else
+	    uint32x4_t xmm1 = vld1q_u32(v1);
+	    uint32x4_t xmm2 = vld1q_u32(v2);
+	    uint32x4_t cmp0 = vceqq_u32(xmm1, xmm2);
+	    uint32x4_t cmp1 = vceqq_u32(xmm1, vextq_u32(xmm2, xmm2, 1));
+	    uint32x4_t cmp2 = vceqq_u32(xmm1, vextq_u32(xmm2, xmm2, 2));
+	    uint32x4_t cmp3 = vceqq_u32(xmm1, vextq_u32(xmm2, xmm2, 3));
+	    cmp0 = vorrq_u32(vorrq_u32(cmp0, cmp1), vorrq_u32(cmp2, cmp3));
+	    // Each matching lane is all ones; make it 1, and add up lanes.
+	    uint64x2_t sum = vpaddlq_u32(vshrq_n_u32(cmp0, 31));
+	    common += vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+#endif
+	    unsigned v1max = v1[3];
+	    unsigned v2max = v2[3];
+	    if (v1max <= v2max) {
+		v1 += 4;
+		if (v1 > v1last)
+		    break;
+	    }
+	    if (v2max <= v1max) {
+		v2 += 4;
+		if (v2 > v2last)
+		    break;
+	    }
+	}
+    }
+#endif
+    /* Finish off with a simple merge. */
+    while (v1 < v1end && v2 < v2end) {
+	if (*v1 < *v2)
+	    v1++;
+	else if (*v1 > *v2)
+	    v2++;
+	else
+	    common++, v1++, v2++;
+    }
+    return common;
+}
+
+/* need struct rpmsetcmpCounts */
+#include "rpmsetcmp.h"
+
+/* Full comparison, with true disjoint detection and counts. */
+static int setcmp_detail(const unsigned *v1, size_t n1,
+			 const unsigned *v2, size_t n2,
+			 struct rpmsetcmpCounts *cnt)
+{
+    size_t common = setcmp_common(v1, n1, v2, n2);
+    cnt->common = common;
+    cnt->only1 = n1 - common;
+    cnt->only2 = n2 - common;
+    if (common == n1 && common == n2)
+	return 0;
+    if (common == n2)
+	return 1;
+    if (common == n1)
+	return -1;
+    if (common == 0)
+	return -3;
+    return -2;
+}
+
+/*
+ * Huge sets, such as aggregated repo-wide Provides, can be compared
+ * on multiple cores.  Since both arrays are sorted, the value space can be
+ * split into ranges, using elements of v1[] as splitters, and the matching
+ * parts of v2[] can be found by bisecting.  Each range is then compared
+ * independently, and the results are combined: v1 is "less or equal"
+ * (or "greater or equal") than v2 only if this holds in each range.
+ *
+ * Note that setcmp can be run on a range of v1[] in place: the elements
+ * past the range, if any, are greater than any element in the range of v2[],
+ * and so they serve as sentinels no worse than the real ones.
+ */
+#include <pthread.h>
+#include <unistd.h>
+
+/* Only use threads when there are that many elements in total.
+ * The merge takes about 15 cycles per element, so that a chunk
+ * of 64K elements outweighs creating and joining a thread tenfold. */
+#ifndef PARALLEL_CROSSOVER
+#define PARALLEL_CROSSOVER (1 << 18)
+#endif
+
+/* However, it is the smaller set that makes the merge slow.  Against
+ * a few Requires, the loop skips through Provides with big strides,
+ * and stops early on a missing element.  Hence both sets must be big. */
+#define PARALLEL_PAYS(n1, n2) \
+	((n1) >= PARALLEL_CROSSOVER / 2 && (n2) >= PARALLEL_CROSSOVER / 2)
+
+/* Each thread should get at least that many elements. */
+#define PARALLEL_CHUNK (PARALLEL_CROSSOVER / 4)
+
+/* Enough for most machines, and keeps the thread args on the stack. */
+#define PARALLEL_MAXTHREADS 16
+
+struct range {
+    const unsigned *v1, *v2;
+    size_t n1, n2;
+    int cmp;
+};
+
+static void *setcmp_range(void *arg)
+{
+    struct range *r = arg;
+    if (r->n1 && r->n2)
+	r->cmp = setcmp(r->v1, r->n1, r->v2, r->n2);
+    else if (r->n1)
+	r->cmp = 1;
+    else if (r->n2)
+	r->cmp = -1;
+    else
+	r->cmp = 0;
+    return NULL;
+}
+
+static int setcmp_parallel(const unsigned *v1, size_t n1,
+			   const unsigned *v2, size_t n2)
+{
+    size_t nt = (n1 + n2) / PARALLEL_CHUNK;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > 0 && nt > (size_t) ncpu)
+	nt = ncpu;
+    if (nt > PARALLEL_MAXTHREADS)
+	nt = PARALLEL_MAXTHREADS;
+    if (nt < 2)
+	return setcmp(v1, n1, v2, n2);
+    /* Split the ranges. */
+    struct range rv[PARALLEL_MAXTHREADS];
+    size_t i1 = 0, i2 = 0;
+    for (size_t t = 0; t < nt; t++) {
+	size_t j1 = n1, j2 = n2;
+	if (t < nt - 1) {
+	    /* The range ends before v1[j1]; find the first v2[j2]
+	     * which belongs to the next range. */
+	    j1 = n1 / nt * (t + 1);
+	    unsigned vmax = v1[j1];
+	    size_t l = i2;
+	    size_t u = n2;
+	    while (l < u) {
+		size_t i = (l + u) / 2;
+		if (v2[i] < vmax)
+		    l = i + 1;
+		else
+		    u = i;
+	    }
+	    j2 = u;
+	}
+	rv[t] = (struct range) { v1 + i1, v2 + i2, j1 - i1, j2 - i2, 0 };
+	i1 = j1, i2 = j2;
+    }
+    /* The first range is done in this thread. */
+    pthread_t tv[PARALLEL_MAXTHREADS];
+    bool started[PARALLEL_MAXTHREADS];
+    for (size_t t = 1; t < nt; t++)
+	started[t] = pthread_create(&tv[t], NULL, setcmp_range, &rv[t]) == 0;
+    setcmp_range(&rv[0]);
+    bool le = 1, ge = 1;
+    for (size_t t = 0; t < nt; t++) {
+	if (t > 0) {
+	    if (started[t])
+		pthread_join(tv[t], NULL);
+	    else
+		setcmp_range(&rv[t]);
+	}
+	int cmp = rv[t].cmp;
+	if (cmp == 1 || cmp == -2)
+	    le = 0;
+	if (cmp == -1 || cmp == -2)
+	    ge = 0;
+    }
+    if (le && ge)
+	return 0;
+    if (ge)
+	return 1;
+    if (le)
+	return -1;
+    return -2;
+}
+
 /*
  * Recall that the elements of a set are not necessarily full 32-bit
  * integers; sets explicitly express their bpp parameter, bits per value.
@@ -231,11 +581,174 @@ static inline void install_sentinels(unsigned *v, int n)
  * After the high bit is stripped, v2[] values are still sorted.
  * It suffices to merge v1[] and v2[].
  */
-/* Reduce a set of (bpp + 1) values to a set of bpp values. */
-static int downsample1(const unsigned *v, size_t n, unsigned *w, int bpp)
+/*
+ * The merge proper is a hot spot, since its three-way branch is taken
+ * at random for hash values and is mispredicted about half the time.
+ * The first remedy is to make the merge branchless: the smaller of the two
+ * values is stored unconditionally, and either or both pointers advance
+ * by the result of the comparison; equal values are stored only once.
+ * The values are below 2^31, so the sign of the difference tells the
+ * order (otherwise, gcc turns the comparisons back into branches).
+ */
+static size_t merge1_scalar(const unsigned *v1, const unsigned *v1end,
+			    const unsigned *v2, const unsigned *v2end,
+			    unsigned mask, unsigned *w)
+{
+    const unsigned *w_start = w;
+    while (v1 < v1end && v2 < v2end) {
+	unsigned v1val = *v1;
+	unsigned v2val = *v2 & mask;
+	unsigned d = v1val - v2val;
+	unsigned lt = d >> 31;
+	*w++ = v2val + (d & -lt);
+	v1 += (d - 1) >> 31;
+	v2 += ~d >> 31;
+    }
+    w = mempcpy(w, v1, (char *) v1end - (char *) v1);
+    while (v2 < v2end)
+	*w++ = *v2++ & mask;
+    return w - w_start;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*
+ * The second remedy is to merge 4 values at a time with a bitonic network:
+ * given two sorted vectors a and b, reversed b is merged into a, which
+ * yields 4 smallest values in a and 4 biggest values in b.  The former
+ * are stored, and the latter are merged with the next vector, taken from
+ * the part whose next value is smaller.  Duplicates, which can only come
+ * from different parts and therefore end up adjacent, are squeezed out
+ * of the result with a shuffle.  This needs SSE4.1 for unsigned min/max,
+ * hence the kernel is selected at runtime.
+ */
+#define SSE41 __attribute__((target("sse4.1")))
+
+static SSE41 inline void bitonic4(__m128i *a, __m128i *b)
+{
+    __m128i x = *a;
+    __m128i y = _mm_shuffle_epi32(*b, _MM_SHUFFLE(0, 1, 2, 3));
+    __m128i lo = _mm_min_epu32(x, y);
+    __m128i hi = _mm_max_epu32(x, y);
+    // both lo and hi are bitonic now, compare at distance 2
+    x = _mm_unpacklo_epi64(lo, hi);
+    y = _mm_unpackhi_epi64(lo, hi);
+    lo = _mm_min_epu32(x, y);
+    hi = _mm_max_epu32(x, y);
+    // and at distance 1
+    x = _mm_unpacklo_epi32(lo, hi);
+    y = _mm_unpackhi_epi32(lo, hi);
+    lo = _mm_unpacklo_epi64(x, y);
+    hi = _mm_unpackhi_epi64(x, y);
+    x = _mm_min_epu32(lo, hi);
+    y = _mm_max_epu32(lo, hi);
+    *a = _mm_unpacklo_epi32(x, y);
+    *b = _mm_unpackhi_epi32(x, y);
+}
+
+/* Shuffles which squeeze out the lanes set in a 4-bit mask. */
+static const uint8_t squeeze4[16][16] __attribute__((aligned(16))) = {
+#define L(i) 4 * i, 4 * i + 1, 4 * i + 2, 4 * i + 3
+#define Z 0x80, 0x80, 0x80, 0x80
+    { L(0), L(1), L(2), L(3) }, { L(1), L(2), L(3), Z },
+    { L(0), L(2), L(3), Z },    { L(2), L(3), Z, Z },
+    { L(0), L(1), L(3), Z },    { L(1), L(3), Z, Z },
+    { L(0), L(3), Z, Z },       { L(3), Z, Z, Z },
+    { L(0), L(1), L(2), Z },    { L(1), L(2), Z, Z },
+    { L(0), L(2), Z, Z },       { L(2), Z, Z, Z },
+    { L(0), L(1), Z, Z },       { L(1), Z, Z, Z },
+    { L(0), Z, Z, Z },          { Z, Z, Z, Z },
+#undef L
+#undef Z
+};
+
+/* Store the sorted vector x, less the values equal to their predecessors
+ * (the predecessor of the first value is the last lane of prev). */
+static SSE41 inline unsigned *store4(unsigned *w, __m128i x, __m128i *prev)
+{
+    __m128i y = _mm_alignr_epi8(x, *prev, 12);
+    int dup = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(x, y)));
+    *prev = x;
+    x = _mm_shuffle_epi8(x, _mm_load_si128((void *) squeeze4[dup]));
+    _mm_storeu_si128((void *) w, x);
+    return w + 4 - __builtin_popcount(dup);
+}
+
+/* Each store of 4 values is covered by the 4 values still held in b,
+ * so the stores never run past the n-th element of w[]. */
+static SSE41 size_t merge1_sse41(const unsigned *v1, const unsigned *v1end,
+				 const unsigned *v2, const unsigned *v2end,
+				 unsigned mask, unsigned *w)
+{
+    if (v1end - v1 < 4 || v2end - v2 < 4)
+	return merge1_scalar(v1, v1end, v2, v2end, mask, w);
+    const unsigned *w_start = w;
+    __m128i xmask = _mm_set1_epi32(mask);
+    __m128i a = _mm_loadu_si128((void *) v1);
+    __m128i b = _mm_and_si128(_mm_loadu_si128((void *) v2), xmask);
+    // the predecessor of the very first value must differ from it
+    unsigned first = *v1 < (*v2 & mask) ? *v1 : *v2 & mask;
+    __m128i prev = _mm_set1_epi32(first - 1);
+    v1 += 4, v2 += 4;
+    while (1) {
+	bitonic4(&a, &b);
+	w = store4(w, a, &prev);
+	if (v1end - v1 < 4 || v2end - v2 < 4)
+	    break;
+	if (*v1 < (*v2 & mask)) {
+	    a = _mm_loadu_si128((void *) v1);
+	    v1 += 4;
+	}
+	else {
+	    a = _mm_and_si128(_mm_loadu_si128((void *) v2), xmask);
+	    v2 += 4;
+	}
+    }
+    /* The 4 values left in b can have duplicates, which are squeezed
+     * out the same way.  Then b is merged with the shorter tail first,
+     * and with the longer one next.  Only the heads of the tails can be
+     * equal to the last value stored. */
+    unsigned last = _mm_extract_epi32(prev, 3);
+    unsigned t[4], u[8];
+    unsigned *tend = store4(t, b, &prev);
+    size_t nu;
+    if (v1end - v1 < 4) {
+	nu = merge1_scalar(v1, v1end, t, tend, ~0u, u);
+	v1 = u, v1end = u + nu;
+    }
+    else {
+	nu = merge1_scalar(t, tend, v2, v2end, mask, u);
+	v2 = u, v2end = u + nu, mask = ~0u;
+    }
+    if (*v1 == last)
+	v1++;
+    if (v2 < v2end && (*v2 & mask) == last)
+	v2++;
+    w += merge1_scalar(v1, v1end, v2, v2end, mask, w);
+    return w - w_start;
+}
+
+/* Selected at runtime. */
+static size_t (*merge1)(const unsigned *v1, const unsigned *v1end,
+			const unsigned *v2, const unsigned *v2end,
+			unsigned mask, unsigned *w) = merge1_scalar;
+
+/* The constructor may run before that of libgcc, which would
+ * otherwise fill in the CPU features for __builtin_cpu_supports. */
+static __attribute__((constructor)) void init_merge1(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+	merge1 = merge1_sse41;
+}
+#else
+#define merge1 merge1_scalar
+#endif
+
+/* Find the first element with high bit set. */
+static size_t highpart(const unsigned *v, size_t n, unsigned mask)
 {
-    unsigned mask = (1U << bpp) - 1;
-    /* Find the first element with high bit set. */
     size_t l = 0;
     size_t u = n;
     while (l < u) {
@@ -245,60 +758,257 @@ static int downsample1(const unsigned *v, size_t n, unsigned *w, int bpp)
 	else
 	    u = i;
     }
-    /* Initialize parts. */
-    const unsigned *w_start = w;
-    const unsigned *v1 = v + 0, *v1end = v + u;
-    const unsigned *v2 = v + u, *v2end = v + n;
-    /* Merge v1 and v2 into w. */
-    if (v1 < v1end && v2 < v2end) {
-	unsigned v1val = *v1;
-	unsigned v2val = *v2 & mask;
-	while (1) {
-	    if (v1val < v2val) {
-		*w++ = v1val;
-		v1++;
-		if (v1 == v1end)
-		    goto left2;
-		v1val = *v1;
+    return u;
+}
+
+/* Reduce a set of (bpp + 1) values to a set of bpp values. */
+static int downsample1(const unsigned *v, size_t n, unsigned *w, int bpp)
+{
+    unsigned mask = (1U << bpp) - 1;
+    size_t u = highpart(v, n, mask);
+    /* Merge the parts; the number of values may decrease. */
+    return merge1(v, v + u, v + u, v + n, mask, w);
+}
+
+/*
+ * Downsampling can also be done in place, which saves the second buffer.
+ * The merge cannot run in place by itself, though: when going forward,
+ * the output overtakes the low part, and when going backward, it overtakes
+ * the high part.  Therefore one of the parts is moved out to scratch
+ * space, whichever is smaller (with a bias towards the faster forward
+ * merge).  The parts are about the same size for hash values, so that
+ * the scratch space takes a little more than n / 2 values.
+ */
+#define DOWNSAMPLE_SCRATCH(n) ((n) / 2 + (n) / 16 + 5)
+
+/* When going backward, the values come in decreasing order; the biggest
+ * value is stored, and the duplicates are stored only once.  The result
+ * ends up at the end of v[], and has to be moved back to the start. */
+static size_t merge1_back(unsigned *v, size_t u, const unsigned *s, size_t m,
+			  size_t n)
+{
+    unsigned *w = v + n;
+    const unsigned *v1 = v + u;
+    const unsigned *v2 = s + m;
+    while (v1 > v && v2 > s) {
+	unsigned v1val = v1[-1];
+	unsigned v2val = v2[-1];
+	unsigned d = v1val - v2val;
+	unsigned lt = d >> 31;
+	*--w = v1val - (d & -lt);
+	v1 -= ~d >> 31;
+	v2 -= (d - 1) >> 31;
+    }
+    /* Either of the parts can be left over, the low part being in place. */
+    size_t k = v2 - s;
+    w -= k;
+    memcpy(w, s, k * sizeof *s);
+    size_t r = v1 - v;
+    if (w > v + r)
+	memmove(v + r, w, (char *) (v + n) - (char *) w);
+    return r + (v + n - w);
+}
+
+/* Reduce a set of (bpp + 1) values to a set of bpp values in place,
+ * using DOWNSAMPLE_SCRATCH(n) values of scratch space s[]. */
+static size_t downsample1_inplace(unsigned *v, size_t n, unsigned *s, int bpp)
+{
+    unsigned mask = (1U << bpp) - 1;
+    size_t u = highpart(v, n, mask);
+    if (u <= n / 2 + n / 16) {
+	memcpy(s, v, u * sizeof *v);
+	return merge1(s, s + u, v + u, v + n, mask, v);
+    }
+    size_t m = n - u;
+    for (size_t i = 0; i < m; i++)
+	s[i] = v[u + i] & mask;
+    return merge1_back(v, u, s, m, n);
+}
+
+/* need malloc */
+#include <stdlib.h>
+#define xmalloc malloc
+
+/*
+ * Reduction by k bits takes k passes of downsample1, each of which merges
+ * the runs pairwise.  Merging all the 2^k runs in a single pass, e.g.
+ * with a tournament tree, still takes k comparisons per value, and it
+ * turns out to be slower than the passes.  However, for large k, it is
+ * cheaper to sort the masked values anew, which can be done in linear
+ * time.  The values are first distributed into buckets by their high bits,
+ * so that each bucket gets only a few values, and then each bucket is
+ * sorted with an insertion sort.  The values are distributed in place,
+ * by following the permutation cycles, and the bucket boundaries fit
+ * into DOWNSAMPLE_SCRATCH(n) values of scratch space s[] (there are fewer
+ * than n / 4 buckets, but at least two).
+ */
+static size_t downsample_radix(unsigned *v, size_t n, unsigned *s, int bpp)
+{
+    unsigned mask = (1U << bpp) - 1;
+    /* About eight values per bucket. */
+    int d = 1;
+    while (d < 16 && d < bpp && ((size_t) 8 << d) < n)
+	d++;
+    int shift = bpp - d;
+    size_t nb = (size_t) 1 << d;
+    /* Bucket starts, and the next free slots in each bucket. */
+    unsigned *cnt = s;
+    unsigned *next = s + nb + 1;
+    memset(cnt, 0, (nb + 1) * sizeof *cnt);
+    for (size_t i = 0; i < n; i++)
+	cnt[((v[i] & mask) >> shift) + 1]++;
+    for (size_t b = 1; b <= nb; b++)
+	cnt[b] += cnt[b-1];
+    memcpy(next, cnt, nb * sizeof *cnt);
+    for (size_t b = 0; b < nb; b++) {
+	while (next[b] < cnt[b+1]) {
+	    unsigned x = v[next[b]] & mask;
+	    size_t c;
+	    while ((c = x >> shift) != b) {
+		unsigned y = v[next[c]];
+		v[next[c]++] = x;
+		x = y & mask;
 	    }
-	    else if (v2val < v1val) {
-		*w++ = v2val;
-		v2++;
-		if (v2 == v2end)
-		    goto left1;
-		v2val = *v2 & mask;
+	    v[next[b]++] = x;
+	}
+    }
+    size_t b0 = 0;
+    for (size_t b = 0; b < nb; b++) {
+	size_t b1 = cnt[b+1];
+	for (size_t i = b0 + 1; i < b1; i++) {
+	    unsigned x = v[i];
+	    size_t j = i;
+	    while (j > b0 && v[j-1] > x) {
+		v[j] = v[j-1];
+		j--;
 	    }
-	    else {
-		*w++ = v1val;
-		v1++;
-		v2++;
-		if (v1 == v1end)
-		    goto left2;
-		if (v2 == v2end)
-		    goto left1;
-		v1val = *v1;
-		v2val = *v2 & mask;
+	    v[j] = x;
+	}
+	b0 = b1;
+    }
+    /* Remove duplicates. */
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++)
+	if (m == 0 || v[i] != v[m-1])
+	    v[m++] = v[i];
+    return m;
+}
+
+/* From this many bits on, sorting beats downsample1 passes.  (Sorting
+ * in place chases the permutation cycles at random, and is much slower
+ * than the vectorized merge, which also speeds up as duplicates go.)
+ * On the Provides of a repository, bench-downsample puts the crossover
+ * at 10 bits: inplace10 takes 100M ticks, and radix10 takes 80M. */
+#define DOWNSAMPLE_RADIXK 10
+
+/* Reduce a set of (bpp + k) values to a set of bpp values in place,
+ * using DOWNSAMPLE_SCRATCH(n) values of scratch space s[]. */
+static size_t downsample_inplace(unsigned *v, size_t n, unsigned *s,
+				 int bpp, int k)
+{
+    if (k >= DOWNSAMPLE_RADIXK)
+	return downsample_radix(v, n, s, bpp);
+    while (k-- > 0)
+	n = downsample1_inplace(v, n, s, bpp + k);
+    return n;
+}
+
+/*
+ * Downsampling Provides by k bits takes k passes over v1[], even when
+ * Requires have only a handful of values.  There is another way to
+ * compare the sets which leaves v1[] intact.  Each Requires value r
+ * can only come from the Provides values r + j * 2^bpp, j < 2^k, and
+ * these candidates can be looked up in v1[] by bisecting.  Since the
+ * candidates are increasing, each next lookup starts where the previous
+ * one stopped.  The total cost is then about n2 * 2^k * log2(n1) steps
+ * of bisecting rather than k * n1 steps of downsampling, which pays off
+ * for small n2 and k, given that a step of bisecting costs about PROBE_COST
+ * steps of downsampling.  (With random sets, probing wins from about
+ * 0.6 * n2 * 2^k * log2(n1) < k * n1 on; PROBE_COST rounds this up.)
+ */
+#define PROBE_COST 1
+static inline bool probe_pays(size_t n1, size_t n2, int k)
+{
+    int lg = 63 - __builtin_clzll(n1 | 1);
+    return k < 16 && (n2 << k) * lg * PROBE_COST < n1 * k;
+}
+
+/*
+ * The "ge" part is simple: each r must be found.  As to the "le" part,
+ * v1[] is a subset of v2[] after downsampling only if each element of v1[]
+ * is found as a candidate of some r, which is only possible if n1 is not
+ * greater than the number of candidates.  In this case, all candidates
+ * should be looked up and counted, otherwise the first one found will do.
+ */
+static int setcmp_probe(const unsigned *v1, size_t n1,
+			const unsigned *v2, size_t n2,
+			int bpp, int k, bool subset)
+{
+    bool le = !subset && n1 <= (n2 << k);
+    bool ge = 1;
+    size_t found = 0;
+    unsigned step = 1U << bpp;
+    size_t nc = (size_t) 1 << k;
+    for (size_t i = 0; i < n2; i++) {
+	bool hit = 0;
+	size_t l = 0;
+	unsigned c = v2[i];
+	for (size_t j = 0; j < nc; j++, c += step) {
+	    size_t u = n1;
+	    while (l < u) {
+		size_t m = (l + u) / 2;
+		if (v1[m] < c)
+		    l = m + 1;
+		else
+		    u = m;
+	    }
+	    if (l == n1)
+		break;
+	    if (v1[l] == c) {
+		hit = 1, found++, l++;
+		if (!le)
+		    break;
 	    }
 	}
+	if (!hit) {
+	    if (subset)
+		return 0;
+	    ge = 0;
+	    if (!le)
+		return -2;
+	}
     }
-    /* In case no merge took place. */
-    w = mempcpy(w, v1, (char *) v1end - (char *) v1);
-left2:
-    /* Append what's left. */
-    while (v2 < v2end)
-	*w++ = *v2++ & mask;
-    /* The number of values may decrease. */
-    return w - w_start;
-left1:
-    w = mempcpy(w, v1, (char *) v1end - (char *) v1);
-    return w - w_start;
+    if (subset)
+	return 1;
+    if (found < n1)
+	le = 0;
+    if (le && ge)
+	return 0;
+    if (ge)
+	return 1;
+    if (le)
+	return -1;
+    return -2;
 }
 
 /* Cache entry holds the decoded set v[n] for the given set-string str.
- * Each entry is allocated in a single malloc chunk. */
+ * The set can also be downsampled, hence the entries are keyed by str
+ * along with bpp.  Each entry is allocated in a single malloc chunk.
+ * The entries are immutable once filled in, and can be shared among
+ * the caches, hence the reference count. */
 struct cache_ent {
+    int refs;
     int len;
+    int bpp;
     int n;
+    /* Full hash of str and bpp, for the shared cache. */
+    uint64_t key;
+    /* Recently used, for the shared cache. */
+    int clock;
+    /* The values, after str[] or in the store. */
+    const unsigned *v;
+    /* The Bloom filter of the values, after v[], or NULL. */
+    const uint64_t *bloom;
     char str[];
     /* After null-terminated str[], there goes v[n], properly aligned.
      * Provide some macros to deal with str[] and access v[]. */
@@ -308,44 +1018,274 @@ struct cache_ent {
 
 /* The cache of this size (about 256 entries) can provide
  * 75% hit ratio while using less than 2MB of malloc chunks. */
+#ifndef CACHE_SIZE
 #define CACHE_SIZE (256 - 1) /* Need sentinel */
+#endif
+
+/* Beyond a few hundred entries, the linear search no longer pays,
+ * and the entries are indexed with a hash table instead (see below). */
+#define CACHE_HASHED (CACHE_SIZE > 256)
+
+/* We use LRU cache with a special first-time insertion policy.
+ * When adding an element to the cache for the first time,
+ * pushing it to the front tends to assign "extra importance"
+ * to that new element, at the expense of other elements that are
+ * already in the cache.  The idea is then to try first-time
+ * insertion somewhere in the middle.  Further attempts suggest
+ * that the midpoint should actually be closer to the end. */
+#define MIDPOINT (CACHE_SIZE * 7 / 8)
+
+/* On a hit, move to front that many steps. */
+#define MOVSTEP 32
+
+struct stats {
+    unsigned long calls;
+    unsigned long hit;
+    unsigned long miss;
+    /* Downsampled entries. */
+    unsigned long dhit;
+    unsigned long dmiss;
+    /* Misses served by the shared cache, and by the store. */
+    unsigned long shared;
+    unsigned long store;
+    /* Provides found in the preloaded index, not counted above. */
+    unsigned long preload;
+    /* Calls answered by the memo. */
+    unsigned long memo;
+    /* Missing Requires found by the filter, and by the merge after it. */
+    unsigned long bloom;
+    unsigned long bloomfp;
+    unsigned long evict;
+    uint64_t cycles;
+    /* Downsampling by k bits. */
+    unsigned long ds[32];
+    /* Requires decoded on the stack and in the scratch buffer. */
+    unsigned long stack;
+    unsigned long scratch;
+    /* The scratch buffer reallocated. */
+    unsigned long grow;
+};
+
+/* The stats are printed at exit if asked for in the environment.
+ * Reading the clock is not free, hence the decode cycles are only
+ * counted then, or once rpmsetcmpStats has been called. */
+#define STATS_ENV "RPMSETCMP_STATS"
+static bool stats_env;
+static bool stats_cycles;
+
+static __attribute__((constructor)) void init_stats(void)
+{
+    const char *s = getenv(STATS_ENV);
+    stats_env = s && *s && strcmp(s, "0");
+    stats_cycles = stats_env;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define stats_clock() __rdtsc()
+#elif defined(__aarch64__)
+static inline uint64_t stats_clock(void)
+{
+    uint64_t t;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+}
+#else
+#define stats_clock() 0
+#endif
+
+/*
+ * The entries vary in size from a few hundred bytes to megabytes, so
+ * the cache can also be limited by memory.  Within the budget, the entries
+ * are evicted by their GDSF priority, which is the decode cost saved per
+ * byte, multiplied by the number of hits, plus the inflation value L, which
+ * is the priority of the last evicted entry (so that the entries which
+ * are no longer used eventually age out).  Without the budget, the last
+ * entry is evicted, as per LRU.
+ */
+struct cache_slot {
+    struct cache_ent *ent;
+    float pri;
+    int freq;
+    /* The caller's pointer to the string, last seen. */
+    const char *ptr;
+#if CACHE_HASHED
+    /* The recency list, and whether in its tail segment. */
+    int prev, next;
+    bool prob;
+#endif
+};
+
+/* Decode cost, in values, including the call overhead. */
+#define ENT_COST(n) ((n) + 64)
+#define ENT_SIZE(len, n) (sizeof(struct cache_ent) + ENT_STRSIZE(len) + \
+			  ((n) + SENTINELS) * sizeof(unsigned) + \
+			  BLOOM_WORDS(n) * sizeof(uint64_t))
+
+/*
+ * Most of the expensive comparisons are unmet dependencies, and the merge
+ * runs through Provides before it finds the missing Requires element.
+ * Hence the decoded Provides also get a Bloom filter, 8 bits per value,
+ * which is probed with the Requires first.  The filter is blocked: each
+ * value sets 3 bits in a single 64-bit word, so that a probe is one load.
+ * A value which is not found is surely missing, and then Provides are not
+ * a superset.  The values are hash values already, and a multiplication
+ * is enough to pick the word and the bits.  The filter makes the entries
+ * a quarter bigger, which is charged to the budgets.  However, the merge
+ * stops early on a missing element anyway, and the filter makes the misses
+ * dearer: it only pays when most dependencies are unmet, hence CACHE_BLOOM=1.
+ */
+#ifndef CACHE_BLOOM
+#define CACHE_BLOOM 0
+#endif
+
+#if CACHE_BLOOM
+#define BLOOM_WORDS(n) (((n) + 7) / 8)
+#else
+#define BLOOM_WORDS(n) (0 * (n))
+#endif
+
+static inline uint64_t bloom_hash(unsigned x, size_t nw, size_t *w)
+{
+    uint64_t h = x * 0x9E3779B97F4A7C15ULL;
+    *w = (h >> 32) * nw >> 32;
+    return 1ULL << (h & 63) | 1ULL << (h >> 6 & 63) | 1ULL << (h >> 12 & 63);
+}
+
+static void bloom_build(uint64_t *f, const unsigned *v, size_t n)
+{
+    size_t nw = BLOOM_WORDS(n), w;
+    memset(f, 0, nw * sizeof *f);
+    for (size_t i = 0; i < n; i++) {
+	uint64_t m = bloom_hash(v[i], nw, &w);
+	f[w] |= m;
+    }
+}
+
+/* Whether some of v2[] is surely missing from the n1 values of f. */
+static inline bool bloom_reject(const uint64_t *f, size_t n1,
+				const unsigned *v2, size_t n2)
+{
+    size_t nw = BLOOM_WORDS(n1), w;
+    for (size_t i = 0; i < n2; i++) {
+	uint64_t m = bloom_hash(v2[i], nw, &w);
+	if ((f[w] & m) != m)
+	    return 1;
+    }
+    return 0;
+}
+
+/* The memory taken by an entry, which the budgets are charged.
+ * The entries which refer to the store hold no values. */
+static inline size_t ent_size(const struct cache_ent *ent)
+{
+    if (ent->v != ENT_V(ent, ent->len))
+	return sizeof(*ent) + ENT_STRSIZE(ent->len);
+    return ENT_SIZE(ent->len, ent->n);
+}
 
-/* We use LRU cache with a special first-time insertion policy.
- * When adding an element to the cache for the first time,
- * pushing it to the front tends to assign "extra importance"
- * to that new element, at the expense of other elements that are
- * already in the cache.  The idea is then to try first-time
- * insertion somewhere in the middle.  Further attempts suggest
- * that the midpoint should actually be closer to the end. */
-#define MIDPOINT (CACHE_SIZE * 7 / 8)
+#if CACHE_HASHED
+/* The table is at most half full. */
+#define CACHE_SLOTS (2 * (CACHE_SIZE + 1))
+_Static_assert((CACHE_SLOTS & (CACHE_SLOTS - 1)) == 0,
+	       "CACHE_SIZE + 1 must be a power of two");
 
-/* On a hit, move to front that many steps. */
-#define MOVSTEP 32
+/* The low bits of the hash, and the index into ev[] plus one. */
+struct cache_ix {
+    uint32_t tag;
+    int i;
+};
+#endif
 
 struct cache {
+#if CACHE_HASHED
+    struct cache_ix ix[CACHE_SLOTS];
+    /* The front of the recency list, the front of its tail segment,
+     * and the size of the head segment (if less than hc, mid is valid). */
+    int head, mid;
+    int nhead;
+#else
     /* We use a separate array of hash(ent->str) values.
      * The search is first done on this array, without touching
      * the entries.  Note that hv[] goes first and gets the best
      * alignment, which might facilitate the search. */
     uint16_t hv[CACHE_SIZE + 1];
+#endif
     /* Total count, initially less than CACHE_SIZE. */
     int hc;
     /* Cache entries. */
-    struct cache_ent *ev[CACHE_SIZE];
+    struct cache_slot ev[CACHE_SIZE];
+    /* Memory used by the entries, and the limit (0 means none). */
+    size_t bytes;
+    size_t budget;
+    bool budget_set;
+    /* The last entry too big for the budget, held while in use. */
+    struct cache_ent *big;
+    float L;
+    /* The caller's strings do not change, see cache_same. */
+    bool immutable;
+    struct stats stats;
+    /* The epoch in which the shared cache is being read, or 0. */
+    unsigned long epoch;
+    /* The list of the readers of the shared cache. */
+    struct cache *next;
+    bool reader;
+    /* The buffers too big for the stack, see scratch_reserve. */
+    unsigned *scratch;
+    size_t scratch_size;
+    size_t scratch_used;
 };
 
-/* need malloc */
-#include <stdlib.h>
-#define xmalloc malloc
+/*
+ * Big Requires, and the scratch space for downsampling, do not fit on the
+ * stack.  Rather than being allocated on each call, they are taken from
+ * the scratch buffer of the context, which only grows, up to SCRATCH_KEEP
+ * values.  The buffers are taken and given back in LIFO order, and the room
+ * for all the buffers of a call is reserved up front, while none are taken.
+ */
+static inline void scratch_reserve(struct cache *c, size_t n)
+{
+    if (n <= c->scratch_size)
+	return;
+    size_t size = 2 * c->scratch_size;
+    if (size < n)
+	size = n;
+    free(c->scratch);
+    c->scratch = xmalloc(size * sizeof(unsigned));
+    c->scratch_size = size;
+    c->stats.grow++;
+}
+
+/* A buffer bigger than this is given back after the call, so that a huge
+ * set does not keep it for the life of the context, outside the budget. */
+#define SCRATCH_KEEP (64 << 10)
+
+static inline void scratch_trim(struct cache *c)
+{
+    if (c->scratch_size > SCRATCH_KEEP) {
+	free(c->scratch);
+	c->scratch = NULL;
+	c->scratch_size = 0;
+    }
+}
 
 /* need rpmssDecode */
 #include "rpmss.h"
 
-static struct stats {
-    int hit;
-    int miss;
-} stats;
+static inline int stats_decode(struct cache *c, const char *s, unsigned *v)
+{
+    if (!__atomic_load_n(&stats_cycles, __ATOMIC_RELAXED))
+	return rpmssDecode(s, v);
+    uint64_t t = stats_clock();
+    int n = rpmssDecode(s, v);
+    c->stats.cycles += stats_clock() - t;
+    return n;
+}
 
+#if CACHE_HASHED
+#define CACHE_HASH(str, len, bpp) hash64(str, len, bpp)
+#define CACHE_TAIL(c) ((c)->ev[(c)->head].prev)
+#else
 static inline unsigned hash16(const char *str, unsigned len)
 {
     uint32_t h;
@@ -355,22 +1295,44 @@ static inline unsigned hash16(const char *str, unsigned len)
     return h >> 16;
 }
 
-#if defined(__SSE2__)
-#include <emmintrin.h>
-#elif defined(__ARM_NEON) || defined(__aarch64__)
-#include <arm_neon.h>
+#define CACHE_HASH(str, len, bpp) (hash16(str, len) ^ (bpp))
+#define CACHE_TAIL(c) ((c)->hc - 1)
 #endif
 
-static int cache_decode(struct cache *c,
-			const char *str, int len,
-			int n /* expected v[] size */,
-			const unsigned **pv)
+static inline float cache_pri(struct cache *c, struct cache_ent *ent, int freq)
+{
+    return c->L + (float) freq * ENT_COST(ent->n) / ent_size(ent);
+}
+
+/* Check if the entry in the slot is for str and bpp.  The caller passes
+ * the same pointer for the same string over and over again, and the whole
+ * string, which can take tens of kilobytes, need not be compared if it is
+ * known not to change; then only a few bytes at the end are checked.
+ * The cached strings are long enough for that. */
+static inline bool cache_same(struct cache *c, struct cache_slot *slot,
+			      const char *str, int len, int bpp)
+{
+    struct cache_ent *ent = slot->ent;
+    if (len != ent->len || bpp != ent->bpp)
+	return 0;
+    if (str == slot->ptr && c->immutable)
+	return memcmp(str + len - 8, ent->str + len - 8, 8) == 0;
+    if (memcmp(str, ent->str, len))
+	return 0;
+    slot->ptr = str;
+    return 1;
+}
+
+#if !CACHE_HASHED
+/* Find the entry for the given str and bpp, move it towards the front. */
+static struct cache_ent *cache_lookup(struct cache *c,
+				      const char *str, int len, int bpp,
+				      unsigned hash)
 {
     int i;
     struct cache_ent *ent;
     uint16_t *hv = c->hv;
-    struct cache_ent **ev = c->ev;
-    unsigned hash = hash16(str, len);
+    struct cache_slot *ev = c->ev;
 #if defined(__SSE2__)
     __m128i xmm0 = _mm_set1_epi16(hash);
 #elif defined(__ARM_NEON) || defined(__aarch64__)
@@ -427,69 +1389,1137 @@ static int cache_decode(struct cache *c,
 	// Found sentinel?
 	if (i == c->hc)
 	    break;
-	// Found an entry
-	ent = ev[i];
-	// Recheck the entry
-	if (len != ent->len || memcmp(str, ent->str, len)) {
+	// Found an entry, recheck
+	if (!cache_same(c, &ev[i], str, len, bpp)) {
 	    hp++;
 	    continue;
 	}
-	// Hit, move to front
+	ent = ev[i].ent;
+	// Hit, bump the priority and move to front
+	struct cache_slot slot = ev[i];
+	slot.freq++;
+	slot.pri = cache_pri(c, ent, slot.freq);
 	if (i > MOVSTEP) {
 	    hv += (unsigned) i - MOVSTEP;
 	    ev += (unsigned) i - MOVSTEP;
 	    memmove(hv + 1, hv, MOVSTEP * sizeof hv[0]);
 	    memmove(ev + 1, ev, MOVSTEP * sizeof ev[0]);
 	    hv[0] = hash;
-	    ev[0] = ent;
+	    i = 0;
+	}
+	ev[i] = slot;
+	return ent;
+    }
+    return NULL;
+}
+#endif
+
+static inline uint64_t hash64(const char *str, size_t len, int bpp)
+{
+    uint64_t h = len * 0x9E3779B97F4A7C15ULL + bpp;
+    uint64_t x;
+    for (; len >= 8; str += 8, len -= 8) {
+	memcpy(&x, str, 8);
+	h = (h ^ x) * 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 32;
+    }
+    x = 0;
+    memcpy(&x, str, len);
+    h = (h ^ x) * 0xFF51AFD7ED558CCDULL;
+    return h ^ (h >> 29);
+}
+
+/*
+ * The entries are allocated from slabs, rather than with malloc, so that
+ * the churn of entries, which vary in size from a kilobyte to megabytes,
+ * does not fragment the heap.  A slab is a 2M mapping, aligned to its size
+ * (so that it can be backed by a huge page), which is carved into objects
+ * of the same size class; there are four classes per power of two.
+ * The header of the slab is found by masking the object's address.
+ * Bigger objects get a mapping of their own, with the same header.
+ * The objects are aligned to cache lines.  A slab is unmapped when its
+ * last object is freed, unless it is the last slab of its class.
+ * The entries can be freed by any thread, hence the lock.
+ * With glibc malloc, this takes about the same time per miss, but
+ * more memory, since each class keeps a partially used slab; with
+ * huge pages, a miss is faster, but the slabs take 2M each.  Hence
+ * the slabs are only used with CACHE_SLAB=1.
+ */
+#ifndef CACHE_SLAB
+#define CACHE_SLAB 0
+#endif
+
+#if CACHE_SLAB
+#include <sys/mman.h>
+
+#define SLAB_SIZE (2 << 20)
+#define SLAB_MAX (SLAB_SIZE / 8)
+#define SLAB_MIN 1024
+#define SLAB_ALIGN 64
+/* Classes from SLAB_MIN to SLAB_MAX, and the big objects. */
+#define SLAB_NCLS (4 * 8 + 1 + 1)
+
+struct slab {
+    struct slab *prev, *next;
+    /* The freed objects, linked through their first word, and the rest
+     * of the slab, which is carved lazily, so as not to touch the pages. */
+    void *free;
+    char *bump;
+    size_t size;
+    size_t osize;
+    int cls;
+    int used;
+} __attribute__((aligned(SLAB_ALIGN)));
+
+static struct {
+    pthread_mutex_t lock;
+    /* The slabs of each class with free objects. */
+    struct slab *partial[SLAB_NCLS];
+    bool huge;
+} SL = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+#define SLAB_HUGE_ENV "RPMSETCMP_HUGEPAGES"
+
+static __attribute__((constructor)) void init_slab(void)
+{
+    const char *s = getenv(SLAB_HUGE_ENV);
+    SL.huge = s && *s && strcmp(s, "0");
+}
+
+/* Round up to the class, 4 per power of two: 1024, 1280, 1536, 1792, ... */
+static inline int slab_cls(size_t size, size_t *csize)
+{
+    if (size <= SLAB_MIN) {
+	*csize = SLAB_MIN;
+	return 0;
+    }
+    int k = 63 - __builtin_clzll(size - 1);
+    size_t q = (size - 1) >> (k - 2);	/* 4..7 */
+    *csize = (q + 1) << (k - 2);
+    return 4 * (k - 10) + (q - 4) + 1;
+}
+
+/* A mapping aligned to SLAB_SIZE. */
+static struct slab *slab_map(size_t size)
+{
+    char *p = mmap(NULL, size + SLAB_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+	return NULL;
+    size_t head = -(uintptr_t) p & (SLAB_SIZE - 1);
+    if (head)
+	munmap(p, head);
+    munmap(p + head + size, SLAB_SIZE - head);
+    p += head;
+#ifdef MADV_HUGEPAGE
+    if (SL.huge)
+	madvise(p, size, MADV_HUGEPAGE);
+#endif
+    struct slab *sl = (struct slab *) p;
+    sl->size = size;
+    sl->used = 0;
+    sl->free = NULL;
+    sl->bump = (char *) (sl + 1);
+    sl->prev = sl->next = NULL;
+    return sl;
+}
+
+static void slab_unlink(struct slab *sl)
+{
+    if (sl->prev)
+	sl->prev->next = sl->next;
+    else
+	SL.partial[sl->cls] = sl->next;
+    if (sl->next)
+	sl->next->prev = sl->prev;
+    sl->prev = sl->next = NULL;
+}
+
+static void slab_link(struct slab *sl)
+{
+    sl->prev = NULL;
+    sl->next = SL.partial[sl->cls];
+    if (sl->next)
+	sl->next->prev = sl;
+    SL.partial[sl->cls] = sl;
+}
+
+static void *slab_alloc(size_t size)
+{
+    size_t csize;
+    if (size > SLAB_MAX) {
+	csize = (sizeof(struct slab) + size + SLAB_SIZE - 1) &
+		~(size_t) (SLAB_SIZE - 1);
+	struct slab *sl = slab_map(csize);
+	if (sl == NULL)
+	    return NULL;
+	sl->cls = SLAB_NCLS - 1;
+	sl->used = 1;
+	return sl + 1;
+    }
+    int cls = slab_cls(size, &csize);
+    pthread_mutex_lock(&SL.lock);
+    struct slab *sl = SL.partial[cls];
+    if (sl == NULL) {
+	sl = slab_map(SLAB_SIZE);
+	if (sl == NULL) {
+	    pthread_mutex_unlock(&SL.lock);
+	    return NULL;
+	}
+	sl->cls = cls;
+	sl->osize = csize;
+	slab_link(sl);
+    }
+    void *obj = sl->free;
+    if (obj)
+	sl->free = *(void **) obj;
+    else {
+	obj = sl->bump;
+	sl->bump += csize;
+    }
+    sl->used++;
+    if (sl->free == NULL && sl->bump + csize > (char *) sl + SLAB_SIZE)
+	slab_unlink(sl);
+    pthread_mutex_unlock(&SL.lock);
+    return obj;
+}
+
+static void slab_free(void *obj)
+{
+    struct slab *sl = (struct slab *)
+	    ((uintptr_t) obj & ~(uintptr_t) (SLAB_SIZE - 1));
+    if (sl->cls == SLAB_NCLS - 1) {
+	munmap(sl, sl->size);
+	return;
+    }
+    pthread_mutex_lock(&SL.lock);
+    bool full = sl->free == NULL &&
+	    sl->bump + sl->osize > (char *) sl + SLAB_SIZE;
+    *(void **) obj = sl->free;
+    sl->free = obj;
+    sl->used--;
+    if (full)
+	slab_link(sl);
+    else if (sl->used == 0 && (sl->prev || sl->next)) {
+	slab_unlink(sl);
+	munmap(sl, SLAB_SIZE);
+    }
+    pthread_mutex_unlock(&SL.lock);
+}
+
+#define ent_malloc slab_alloc
+#define ent_free slab_free
+#else
+#define ent_malloc xmalloc
+#define ent_free free
+#endif
+
+/* Allocate a new entry for str, with room for nv values,
+ * and for the filter, unless the values are elsewhere. */
+static struct cache_ent *cache_alloc(const char *str, int len, int bpp, int nv)
+{
+    struct cache_ent *ent;
+    size_t nw = nv > SENTINELS ? BLOOM_WORDS(nv - SENTINELS) : 0;
+    size_t off = ENT_STRSIZE(len) + nv * sizeof(unsigned);
+    ent = ent_malloc(sizeof(*ent) + off +
+		     (nw ? nw + 1 : 0) * sizeof(uint64_t));
+    ent->bloom = NULL;
+    if (nw)
+	ent->bloom = (uint64_t *) (((uintptr_t) ent->str + off + 7) & ~(uintptr_t) 7);
+    ent->refs = 1;
+    ent->len = len;
+    ent->bpp = bpp;
+    ent->key = hash64(str, len, bpp);
+    ent->clock = 0;
+    ent->v = ENT_V(ent, len);
+    memcpy(ent->str, str, len + 1);
+    return ent;
+}
+
+/* Drop a reference. */
+static void ent_put(struct cache_ent *ent)
+{
+    if (__atomic_sub_fetch(&ent->refs, 1, __ATOMIC_ACQ_REL) == 0)
+	ent_free(ent);
+}
+
+/* The budget is taken from the environment, unless set explicitly;
+ * the value is in bytes, with an optional K, M or G suffix. */
+#define CACHE_BUDGET_ENV "RPMSETCMP_CACHE_BUDGET"
+
+static size_t budget_env(const char *name, size_t dflt)
+{
+    const char *s = getenv(name);
+    if (s == NULL)
+	return dflt;
+    char *end;
+    size_t budget = strtoull(s, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': budget <<= 10; /* FALLTHRU */
+    case 'M': case 'm': budget <<= 10; /* FALLTHRU */
+    case 'K': case 'k': budget <<= 10;
+    }
+    return budget;
+}
+
+#if !CACHE_HASHED
+/* Remove the i-th entry. */
+static void cache_evict(struct cache *c, int i)
+{
+    struct cache_ent *ent = c->ev[i].ent;
+    c->bytes -= ent_size(ent);
+    c->stats.evict++;
+    c->hc--;
+    memmove(c->hv + i, c->hv + i + 1, (c->hc - i) * sizeof c->hv[0]);
+    memmove(c->ev + i, c->ev + i + 1, (c->hc - i) * sizeof c->ev[0]);
+    ent_put(ent);
+}
+#endif
+
+/* Which entry to evict: the last one, or the one with the lowest
+ * priority, which then becomes the inflation value. */
+static int cache_victim(struct cache *c)
+{
+    if (c->budget == 0)
+	return CACHE_TAIL(c);
+    int k = 0;
+    for (int i = 1; i < c->hc; i++)
+	if (c->ev[i].pri < c->ev[k].pri)
+	    k = i;
+    c->L = c->ev[k].pri;
+    return k;
+}
+
+static inline void cache_budget_init(struct cache *c)
+{
+    if (!c->budget_set) {
+	c->budget = budget_env(CACHE_BUDGET_ENV, 0);
+	c->budget_set = 1;
+    }
+}
+
+/* An entry bigger than the whole budget is not cached; it is only
+ * held until the next such entry comes, since it is still in use. */
+static inline bool cache_hold(struct cache *c, struct cache_ent *ent,
+			      size_t size)
+{
+    if (c->budget == 0 || size <= c->budget)
+	return 0;
+    if (c->big)
+	ent_put(c->big);
+    c->big = ent;
+    return 1;
+}
+
+#if !CACHE_HASHED
+/* Insert the new entry at the midpoint. */
+static void cache_insert(struct cache *c, struct cache_ent *ent,
+			 const char *str, unsigned hash)
+{
+    int i;
+    uint16_t *hv = c->hv;
+    struct cache_slot *ev = c->ev;
+    cache_budget_init(c);
+    size_t size = ent_size(ent);
+    if (cache_hold(c, ent, size))
+	return;
+    // make room
+    while (c->hc == CACHE_SIZE || (c->budget && c->hc &&
+				   c->bytes + size > c->budget))
+	cache_evict(c, cache_victim(c));
+    c->bytes += size;
+    if (c->hc <= MIDPOINT)
+	i = c->hc++;
+    else {
+	c->hc++;
+	// position at the midpoint
+	i = MIDPOINT;
+	memmove(hv + i + 1, hv + i, (c->hc - i - 1) * sizeof hv[0]);
+	memmove(ev + i + 1, ev + i, (c->hc - i - 1) * sizeof ev[0]);
+    }
+    hv[i] = hash;
+    ev[i] = (struct cache_slot) { ent, cache_pri(c, ent, 1), 1, str };
+}
+#else
+/*
+ * With thousands of entries, the entries are indexed by an open-addressed
+ * table with linear probing, keyed by the full hash, so that a lookup
+ * takes a probe or two regardless of the size.  On removal, the following
+ * entries in the run are shifted back, so that there are no tombstones.
+ * The recency order is kept by a circular list threaded through ev[],
+ * which is split at the midpoint: new entries go to the front of the tail
+ * segment, hits go to the front of the list, and when the head segment
+ * grows past MIDPOINT, its last entry slides back into the tail segment.
+ */
+#define IX_NEXT(p) (((p) + 1) & (CACHE_SLOTS - 1))
+
+/* The slot which refers to ev[i]. */
+static inline size_t cache_ix_find(struct cache *c, uint64_t key, int i)
+{
+    size_t p = key & (CACHE_SLOTS - 1);
+    while (c->ix[p].i != i + 1)
+	p = IX_NEXT(p);
+    return p;
+}
+
+static void cache_ix_delete(struct cache *c, size_t p)
+{
+    struct cache_ix *ix = c->ix;
+    for (size_t q = IX_NEXT(p); ix[q].i; q = IX_NEXT(q)) {
+	// can ix[q] move back to p, i.e. is p between its home and q?
+	size_t home = ix[q].tag & (CACHE_SLOTS - 1);
+	if (((q - home) & (CACHE_SLOTS - 1)) >= ((q - p) & (CACHE_SLOTS - 1))) {
+	    ix[p] = ix[q];
+	    p = q;
+	}
+    }
+    ix[p].i = 0;
+}
+
+/* Link ev[i] before ev[j]. */
+static inline void cache_link(struct cache_slot *ev, int i, int j)
+{
+    int k = ev[j].prev;
+    ev[i].prev = k;
+    ev[i].next = j;
+    ev[k].next = i;
+    ev[j].prev = i;
+}
+
+static inline void cache_unlink(struct cache_slot *ev, int i)
+{
+    ev[ev[i].prev].next = ev[i].next;
+    ev[ev[i].next].prev = ev[i].prev;
+}
+
+/* Find the entry for the given str and bpp, move it to front. */
+static struct cache_ent *cache_lookup(struct cache *c,
+				      const char *str, int len, int bpp,
+				      uint64_t hash)
+{
+    struct cache_slot *ev = c->ev;
+    int i;
+    size_t p = hash & (CACHE_SLOTS - 1);
+    for (; (i = c->ix[p].i); p = IX_NEXT(p)) {
+	if (c->ix[p].tag != (uint32_t) hash)
+	    continue;
+	struct cache_ent *ent = ev[--i].ent;
+	if (ent->key != hash || !cache_same(c, &ev[i], str, len, bpp))
+	    continue;
+	// Hit, bump the priority and move to front
+	ev[i].freq++;
+	ev[i].pri = cache_pri(c, ent, ev[i].freq);
+	if (ev[i].prob) {
+	    ev[i].prob = 0;
+	    if (i == c->mid)
+		c->mid = ev[i].next;
+	    c->nhead++;
+	}
+	if (i != c->head) {
+	    cache_unlink(ev, i);
+	    cache_link(ev, i, c->head);
+	    c->head = i;
+	}
+	if (c->nhead > MIDPOINT) {
+	    int j = c->nhead == c->hc ? CACHE_TAIL(c) : ev[c->mid].prev;
+	    ev[j].prob = 1;
+	    c->mid = j;
+	    c->nhead--;
+	}
+	return ent;
+    }
+    return NULL;
+}
+
+/* Remove the i-th entry; the last entry takes its place in ev[]. */
+static void cache_evict(struct cache *c, int i)
+{
+    struct cache_slot *ev = c->ev;
+    struct cache_ent *ent = ev[i].ent;
+    c->bytes -= ent_size(ent);
+    c->stats.evict++;
+    cache_ix_delete(c, cache_ix_find(c, ent->key, i));
+    if (!ev[i].prob)
+	c->nhead--;
+    else if (i == c->mid)
+	c->mid = ev[i].next;
+    if (i == c->head)
+	c->head = ev[i].next;
+    cache_unlink(ev, i);
+    int last = --c->hc;
+    if (i < last) {
+	c->ix[cache_ix_find(c, ev[last].ent->key, last)].i = i + 1;
+	ev[i] = ev[last];
+	if (ev[i].next == last)
+	    ev[i].prev = ev[i].next = i;
+	else {
+	    ev[ev[i].prev].next = i;
+	    ev[ev[i].next].prev = i;
+	}
+	if (c->head == last)
+	    c->head = i;
+	if (c->mid == last)
+	    c->mid = i;
+    }
+    ent_put(ent);
+}
+
+/* Insert the new entry at the front of the tail segment. */
+static void cache_insert(struct cache *c, struct cache_ent *ent,
+			 const char *str, uint64_t hash)
+{
+    struct cache_slot *ev = c->ev;
+    cache_budget_init(c);
+    size_t size = ent_size(ent);
+    if (cache_hold(c, ent, size))
+	return;
+    // make room
+    while (c->hc == CACHE_SIZE || (c->budget && c->hc &&
+				   c->bytes + size > c->budget))
+	cache_evict(c, cache_victim(c));
+    c->bytes += size;
+    int i = c->hc;
+    ev[i] = (struct cache_slot) { ent, cache_pri(c, ent, 1), 1, str, i, i, 1 };
+    if (c->hc)
+	cache_link(ev, i, c->nhead < c->hc ? c->mid : c->head);
+    if (c->nhead == 0)
+	c->head = i;
+    c->mid = i;
+    c->hc++;
+    size_t p = hash & (CACHE_SLOTS - 1);
+    while (c->ix[p].i)
+	p = IX_NEXT(p);
+    c->ix[p] = (struct cache_ix) { hash, i + 1 };
+}
+#endif
+
+/*
+ * Besides the per-context caches, there is a process-wide cache, which
+ * the contexts consult on a miss, and to which they add what they decode.
+ * The shared cache is read-mostly, and the lookups take no locks.  It is
+ * an open-addressed table with linear probing, keyed by the full hash
+ * of the string and bpp; evicted entries leave tombstones.  Insertions,
+ * which also evict entries with the CLOCK algorithm, take a mutex.
+ * The table holds a reference to each entry, and the per-context caches
+ * take their own references.  However, a reader can load an entry just
+ * before it is evicted, and before it takes its reference.  Hence the
+ * table's reference to an evicted entry is dropped only after all the
+ * readers have left the epoch in which the entry was evicted.
+ * Like the per-context caches, the table is also limited by memory,
+ * so that an entry is freed once it is evicted from both.
+ */
+#ifndef SHARED_CACHE_SIZE
+#define SHARED_CACHE_SIZE 2048
+#endif
+#define SHARED_BUDGET_ENV "RPMSETCMP_SHARED_BUDGET"
+#ifndef SHARED_BUDGET
+#define SHARED_BUDGET (64 << 20)
+#endif
+#define SHARED_SLOTS (SHARED_CACHE_SIZE * 4)
+#define TOMB ((struct cache_ent *) 1)
+
+struct retired {
+    struct cache_ent *ent;
+    unsigned long epoch;
+};
+
+static struct shared {
+    struct cache_ent *slot[SHARED_SLOTS];
+    pthread_mutex_t lock;
+    unsigned long epoch;
+    int count;
+    int tombs;
+    int hand;
+    /* Memory used by the entries, and the limit (0 means none). */
+    size_t bytes;
+    size_t budget;
+    bool budget_set;
+    struct cache *readers;
+    struct retired *rv;
+    int rc, rmax;
+} S = { .lock = PTHREAD_MUTEX_INITIALIZER, .epoch = 1 };
+
+static inline bool shared_match(struct cache_ent *ent, const char *str,
+				int len, int bpp, uint64_t key)
+{
+    return ent != TOMB && ent->key == key &&
+	   ent->len == len && ent->bpp == bpp && memcmp(str, ent->str, len) == 0;
+}
+
+/* Returns the entry with a reference taken, or NULL. */
+static struct cache_ent *shared_lookup(struct cache *c,
+				       const char *str, int len, int bpp)
+{
+    if (!c->reader) {
+	pthread_mutex_lock(&S.lock);
+	c->next = S.readers;
+	S.readers = c;
+	c->reader = 1;
+	pthread_mutex_unlock(&S.lock);
+    }
+    uint64_t key = hash64(str, len, bpp);
+    // enter the current epoch, before loading any entries
+    unsigned long epoch = __atomic_load_n(&S.epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&c->epoch, epoch, __ATOMIC_SEQ_CST);
+    size_t i = key & (SHARED_SLOTS - 1);
+    struct cache_ent *ent;
+    while ((ent = __atomic_load_n(&S.slot[i], __ATOMIC_SEQ_CST))) {
+	if (shared_match(ent, str, len, bpp, key)) {
+	    __atomic_add_fetch(&ent->refs, 1, __ATOMIC_RELAXED);
+	    if (!__atomic_load_n(&ent->clock, __ATOMIC_RELAXED))
+		__atomic_store_n(&ent->clock, 1, __ATOMIC_RELAXED);
+	    break;
+	}
+	i = (i + 1) & (SHARED_SLOTS - 1);
+    }
+    __atomic_store_n(&c->epoch, 0, __ATOMIC_RELEASE);
+    return ent;
+}
+
+static void shared_unregister(struct cache *c)
+{
+    if (!c->reader)
+	return;
+    pthread_mutex_lock(&S.lock);
+    struct cache **pp = &S.readers;
+    while (*pp != c)
+	pp = &(*pp)->next;
+    *pp = c->next;
+    pthread_mutex_unlock(&S.lock);
+}
+
+/* The following functions run under the lock. */
+
+static void shared_evict(void)
+{
+    while (1) {
+	struct cache_ent *ent = S.slot[S.hand];
+	int i = S.hand;
+	S.hand = (S.hand + 1) & (SHARED_SLOTS - 1);
+	if (ent == NULL || ent == TOMB)
+	    continue;
+	if (__atomic_load_n(&ent->clock, __ATOMIC_RELAXED)) {
+	    __atomic_store_n(&ent->clock, 0, __ATOMIC_RELAXED);
+	    continue;
+	}
+	__atomic_store_n(&S.slot[i], TOMB, __ATOMIC_SEQ_CST);
+	S.count--;
+	S.tombs++;
+	S.bytes -= ent_size(ent);
+	if (S.rc == S.rmax) {
+	    S.rmax = S.rmax ? 2 * S.rmax : 64;
+	    S.rv = realloc(S.rv, S.rmax * sizeof S.rv[0]);
+	}
+	S.rv[S.rc++] = (struct retired) { ent, S.epoch };
+	__atomic_store_n(&S.epoch, S.epoch + 1, __ATOMIC_SEQ_CST);
+	return;
+    }
+}
+
+/* Drop the table's references to the entries which no reader can see. */
+static void shared_reclaim(void)
+{
+    unsigned long min = __atomic_load_n(&S.epoch, __ATOMIC_SEQ_CST);
+    for (struct cache *c = S.readers; c; c = c->next) {
+	unsigned long epoch = __atomic_load_n(&c->epoch, __ATOMIC_SEQ_CST);
+	if (epoch && epoch < min)
+	    min = epoch;
+    }
+    int j = 0;
+    for (int i = 0; i < S.rc; i++)
+	if (S.rv[i].epoch < min)
+	    ent_put(S.rv[i].ent);
+	else
+	    S.rv[j++] = S.rv[i];
+    S.rc = j;
+}
+
+/* Too many tombstones make for long probes.  While the entries are being
+ * moved, the readers can miss them, which is harmless. */
+static void shared_rehash(void)
+{
+    struct cache_ent **ev = xmalloc(S.count * sizeof ev[0]);
+    int n = 0;
+    for (int i = 0; i < SHARED_SLOTS; i++) {
+	struct cache_ent *ent = S.slot[i];
+	if (ent && ent != TOMB)
+	    ev[n++] = ent;
+	__atomic_store_n(&S.slot[i], NULL, __ATOMIC_SEQ_CST);
+    }
+    for (int j = 0; j < n; j++) {
+	size_t i = ev[j]->key & (SHARED_SLOTS - 1);
+	while (S.slot[i])
+	    i = (i + 1) & (SHARED_SLOTS - 1);
+	__atomic_store_n(&S.slot[i], ev[j], __ATOMIC_SEQ_CST);
+    }
+    S.tombs = 0;
+    free(ev);
+}
+
+static inline void shared_budget_init(void)
+{
+    if (!S.budget_set) {
+	S.budget = budget_env(SHARED_BUDGET_ENV, SHARED_BUDGET);
+	S.budget_set = 1;
+    }
+}
+
+/* Publish the new entry, unless another thread has done it meanwhile.
+ * Returns the entry to use, with a reference taken.  An entry bigger
+ * than the whole budget is not published. */
+static struct cache_ent *shared_insert(struct cache_ent *ent)
+{
+    pthread_mutex_lock(&S.lock);
+    shared_budget_init();
+    size_t size = ent_size(ent);
+    if (S.budget && size > S.budget) {
+	pthread_mutex_unlock(&S.lock);
+	return ent;
+    }
+    size_t i = ent->key & (SHARED_SLOTS - 1);
+    size_t tomb = SHARED_SLOTS;
+    struct cache_ent *old;
+    while ((old = S.slot[i])) {
+	if (old == TOMB) {
+	    if (tomb == SHARED_SLOTS)
+		tomb = i;
+	}
+	else if (shared_match(old, ent->str, ent->len, ent->bpp, ent->key)) {
+	    __atomic_add_fetch(&old->refs, 1, __ATOMIC_RELAXED);
+	    pthread_mutex_unlock(&S.lock);
+	    ent_put(ent);
+	    return old;
+	}
+	i = (i + 1) & (SHARED_SLOTS - 1);
+    }
+    if (tomb < SHARED_SLOTS) {
+	i = tomb;
+	S.tombs--;
+    }
+    // the table's reference
+    ent->refs++;
+    __atomic_store_n(&S.slot[i], ent, __ATOMIC_SEQ_CST);
+    S.count++;
+    S.bytes += size;
+    while (S.count > SHARED_CACHE_SIZE || (S.budget && S.bytes > S.budget))
+	shared_evict();
+    if (S.tombs > SHARED_CACHE_SIZE)
+	shared_rehash();
+    shared_reclaim();
+    pthread_mutex_unlock(&S.lock);
+    return ent;
+}
+
+/*
+ * The decoded Provides can also be kept in a file, so that they survive
+ * across runs.  The file is mapped into memory and consulted on a miss,
+ * before decoding.  The sets are found by a 128-bit hash of the string,
+ * in an open-addressed table.  The hash is not keyed, and a string could
+ * be crafted to collide with another one, hence the strings are kept
+ * as well, and compared on a hit.  The arrays come with the sentinels
+ * installed, aligned to cache lines, and are used in place.  The file
+ * is never modified, but replaced.
+ */
+#define STORE_ENV "RPMSETCMP_STORE"
+#define STORE_MAGIC "rpmsets2"
+#define STORE_ALIGN 64
+
+struct store_hdr {
+    char magic[8];
+    uint32_t sentinels;
+    uint32_t nslots;	/* a power of two */
+    uint32_t count;
+    uint32_t pad;
+};
+
+struct store_slot {
+    uint64_t key[2];	/* 0 means empty */
+    uint32_t len;
+    uint32_t bpp;
+    uint32_t n;
+    uint32_t pad;
+    uint64_t off;	/* of v[n + SENTINELS] */
+    uint64_t str;	/* of str[len + 1] */
+};
+
+/* The high bit of the first half is set, so that the key is non-zero. */
+static inline void hash128(const char *str, size_t len, uint64_t key[2])
+{
+    uint64_t h0 = len * 0x9E3779B97F4A7C15ULL;
+    uint64_t h1 = ~len * 0xC2B2AE3D27D4EB4FULL;
+    uint64_t x;
+    for (; len >= 8; str += 8, len -= 8) {
+	memcpy(&x, str, 8);
+	h0 = (h0 ^ x) * 0xFF51AFD7ED558CCDULL;
+	h1 = (h1 + x) * 0xC4CEB9FE1A85EC53ULL;
+	h0 ^= h0 >> 32;
+	h1 ^= h1 >> 29;
+    }
+    x = 0;
+    memcpy(&x, str, len);
+    h0 = (h0 ^ x) * 0xFF51AFD7ED558CCDULL;
+    h1 = (h1 + x) * 0xC4CEB9FE1A85EC53ULL;
+    h0 ^= h1 >> 31;
+    h1 ^= h0 >> 33;
+    key[0] = (h0 * 0x9E3779B97F4A7C15ULL) | (1ULL << 63);
+    key[1] = h1 * 0xFF51AFD7ED558CCDULL;
+}
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static struct {
+    const struct store_hdr *hdr;
+    const struct store_slot *slot;
+    size_t size;
+} ST;
+
+static pthread_once_t store_once = PTHREAD_ONCE_INIT;
+
+/* A file which does not check out is ignored.  The slots are checked
+ * as they are found, so that the whole table need not be read up front. */
+static bool store_valid(const struct store_hdr *hdr, size_t size)
+{
+    if (size < sizeof *hdr || memcmp(hdr->magic, STORE_MAGIC, 8) ||
+	    hdr->sentinels != SENTINELS)
+	return 0;
+    size_t nslots = hdr->nslots;
+    return nslots && (nslots & (nslots - 1)) == 0 &&
+	   (size - sizeof *hdr) / sizeof(struct store_slot) >= nslots;
+}
+
+static inline bool store_slot_valid(const struct store_slot *slot)
+{
+    uint64_t off = slot->off;
+    return slot->n > 0 && off % STORE_ALIGN == 0 && off <= ST.size &&
+	   (ST.size - off) / sizeof(unsigned) >= slot->n + (uint64_t) SENTINELS &&
+	   slot->str <= ST.size && ST.size - slot->str > slot->len;
+}
+
+static void store_open(void)
+{
+    const char *path = getenv(STORE_ENV);
+    if (path == NULL || *path == '\0')
+	return;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+	return;
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+	return;
+    if (!store_valid(base, st.st_size)) {
+	munmap(base, st.st_size);
+	return;
+    }
+    ST.hdr = base;
+    ST.slot = (const void *) (ST.hdr + 1);
+    ST.size = st.st_size;
+}
+
+/* Returns the values with sentinels installed, or NULL. */
+static const unsigned *store_lookup(const char *str, int len, int bpp, int *pn)
+{
+    pthread_once(&store_once, store_open);
+    if (ST.hdr == NULL)
+	return NULL;
+    uint64_t key[2];
+    hash128(str, len, key);
+    size_t mask = ST.hdr->nslots - 1;
+    size_t i = key[0] & mask;
+    for (size_t k = 0; k <= mask && ST.slot[i].key[0];
+	    k++, i = (i + 1) & mask) {
+	const struct store_slot *slot = &ST.slot[i];
+	if (slot->key[0] == key[0] && slot->key[1] == key[1] &&
+		slot->len == (uint32_t) len && slot->bpp == (uint32_t) bpp) {
+	    if (!store_slot_valid(slot) ||
+		    memcmp((const char *) ST.hdr + slot->str, str, len))
+		break;
+	    *pn = slot->n;
+	    return (const unsigned *) ((const char *) ST.hdr + slot->off);
+	}
+    }
+    return NULL;
+}
+
+/*
+ * A resolver which loads a repository knows all the Provides up front.
+ * They can be decoded in advance, on all cores, into a single arena,
+ * and looked up with a perfect hash, which takes a single probe.  The
+ * lookup comes after the private cache, so that the cached sets are still
+ * found by their pointers, and the hits leave no trace in the cache.
+ * The slots are those of the store, and the arrays and the strings,
+ * which are compared on a hit, are laid out the same way.  The perfect
+ * hash is built by hash and displace: the keys are split into buckets
+ * by key[0], and each bucket, the largest first, gets a displacement
+ * which scatters its keys by key[1] into free slots.
+ */
+struct preload {
+    uint32_t mask;	/* of slot[], a power of two */
+    uint32_t bmask;	/* of disp[] */
+    uint32_t *disp;
+    struct store_slot *slot;
+    char *arena;
+    int count;
+};
+
+static struct preload *PL;
+
+static inline size_t preload_pos(uint64_t key1, uint32_t d, uint32_t mask)
+{
+    uint64_t x = key1 + d * 0x9E3779B97F4A7C15ULL;
+    x ^= x >> 29;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 32;
+    return x & mask;
+}
+
+static const unsigned *preload_lookup(const char *str, int len, int bpp,
+				      int *pn)
+{
+    struct preload *pl = __atomic_load_n(&PL, __ATOMIC_ACQUIRE);
+    if (pl == NULL)
+	return NULL;
+    uint64_t key[2];
+    hash128(str, len, key);
+    uint32_t d = pl->disp[key[0] & pl->bmask];
+    const struct store_slot *slot =
+	    &pl->slot[preload_pos(key[1], d, pl->mask)];
+    if (slot->key[0] == key[0] && slot->key[1] == key[1] &&
+	    slot->len == (uint32_t) len && slot->bpp == (uint32_t) bpp &&
+	    memcmp(pl->arena + slot->str, str, len) == 0) {
+	*pn = slot->n;
+	return (const unsigned *) (pl->arena + slot->off);
+    }
+    return NULL;
+}
+
+static void preload_free(struct preload *pl)
+{
+    if (pl) {
+	free(pl->disp);
+	free(pl->slot);
+	free(pl->arena);
+	free(pl);
+    }
+}
+
+/* On a miss, the entry comes from the shared cache or the store, or else
+ * the set is decoded and published.  Returns the entry with a reference
+ * taken, or NULL with the decoder error in *pn. */
+static struct cache_ent *shared_decode(struct cache *c,
+				       const char *str, int len, int bpp,
+				       int *pn /* expected v[] size */)
+{
+    int n = *pn;
+    const unsigned *v1;
+    struct cache_ent *ent = shared_lookup(c, str, len, bpp);
+    if (ent)
+	c->stats.shared++;
+    else if ((v1 = store_lookup(str, len, bpp, &n))) {
+	// the entry refers to the store
+	c->stats.store++;
+	ent = cache_alloc(str, len, bpp, 0);
+	ent->v = v1;
+	ent->n = n;
+	ent = shared_insert(ent);
+    }
+    else {
+	// decode
+	ent = cache_alloc(str, len, bpp, n + SENTINELS);
+	unsigned *v = ENT_V(ent, len);
+	n = stats_decode(c, str, v);
+	if (n <= 0) {
+	    ent_free(ent);
+	    *pn = n;
+	    return NULL;
 	}
-	stats.hit++;
-	*pv = ENT_V(ent, len);
+	install_sentinels(v, n);
+	if (ent->bloom)
+	    bloom_build((uint64_t *) ent->bloom, v, n);
+	ent->n = n;
+	ent = shared_insert(ent);
+    }
+    return ent;
+}
+
+static int cache_decode(struct cache *c,
+			const char *str, int len, int bpp,
+			int n /* expected v[] size */,
+			const unsigned **pv, const uint64_t **pbloom)
+{
+    uint64_t hash = CACHE_HASH(str, len, bpp);
+    struct cache_ent *ent = cache_lookup(c, str, len, bpp, hash);
+    if (ent) {
+	c->stats.hit++;
+	*pv = ent->v;
+	*pbloom = ent->bloom;
 	return ent->n;
     }
-    stats.miss++;
-    // decode
-    ent = xmalloc(sizeof(*ent) + ENT_STRSIZE(len) + (n + SENTINELS) * sizeof(unsigned));
-    unsigned *v = ENT_V(ent, len);
-    n = rpmssDecode(str, v);
-    if (n <= 0) {
-	free(ent);
+    const unsigned *v1;
+    if ((v1 = preload_lookup(str, len, bpp, &n))) {
+	c->stats.preload++;
+	*pv = v1;
+	*pbloom = NULL;
 	return n;
     }
-    install_sentinels(v, n);
-    ent->len = len;
-    ent->n = n;
-    memcpy(ent->str, str, len + 1);
-    // insert
-    if (c->hc <= MIDPOINT)
-	i = c->hc++;
+    c->stats.miss++;
+    ent = shared_decode(c, str, len, bpp, &n);
+    if (ent == NULL)
+	return n;
+    cache_insert(c, ent, str, hash);
+    *pv = ent->v;
+    *pbloom = ent->bloom;
+    return ent->n;
+}
+
+/* When packages with different bpp require the same Provides, the Provides
+ * get downsampled over and over again.  Hence the downsampled sets are
+ * also cached, as separate entries, keyed by their bpp. */
+static int cache_downsample(struct cache *c,
+			    const char *str, int len, int bpp1,
+			    int n /* expected v[] size */,
+			    int bpp, const unsigned **pv,
+			    const uint64_t **pbloom)
+{
+    uint64_t hash = CACHE_HASH(str, len, bpp);
+    struct cache_ent *ent = cache_lookup(c, str, len, bpp, hash);
+    if (ent) {
+	c->stats.dhit++;
+	*pv = ent->v;
+	*pbloom = ent->bloom;
+	return ent->n;
+    }
+    c->stats.dmiss++;
+    ent = shared_lookup(c, str, len, bpp);
+    if (ent)
+	c->stats.shared++;
     else {
-	// free last entry
-	if (c->hc < CACHE_SIZE)
-	    c->hc++;
-	else
-	    free(ev[CACHE_SIZE - 1]);
-	// position at the midpoint
-	i = MIDPOINT;
-	memmove(hv + i + 1, hv + i, (CACHE_SIZE - i - 1) * sizeof hv[0]);
-	memmove(ev + i + 1, ev + i, (CACHE_SIZE - i - 1) * sizeof ev[0]);
+	// the full set, hopefully cached
+	const unsigned *v1;
+	const uint64_t *bloom1;
+	n = cache_decode(c, str, len, bpp1, n, &v1, &bloom1);
+	if (n <= 0)
+	    return n;
+	// downsample, the first pass goes into the new entry
+	ent = cache_alloc(str, len, bpp, n + SENTINELS);
+	unsigned *v = ENT_V(ent, len);
+	c->stats.ds[bpp1 - bpp]++;
+	n = downsample1(v1, n, v, bpp1 - 1);
+	if (bpp1 - 1 > bpp) {
+	    scratch_reserve(c, DOWNSAMPLE_SCRATCH(n));
+	    n = downsample_inplace(v, n, c->scratch, bpp, bpp1 - 1 - bpp);
+	}
+	install_sentinels(v, n);
+	if (ent->bloom)
+	    bloom_build((uint64_t *) ent->bloom, v, n);
+	ent->n = n;
+	ent = shared_insert(ent);
     }
-    hv[i] = hash;
-    ev[i] = ent;
-    *pv = v;
-    return n;
+    cache_insert(c, ent, str, hash);
+    *pv = ent->v;
+    *pbloom = ent->bloom;
+    return ent->n;
+}
+
+static void cache_free(struct cache *c)
+{
+    shared_unregister(c);
+    for (int i = 0; i < c->hc; i++)
+	ent_put(c->ev[i].ent);
+    if (c->big)
+	ent_put(c->big);
+    free(c->scratch);
+}
+
+/*
+ * Many packages have the same Requires, and so the same pairs of strings
+ * are compared over and over again.  The results can be remembered,
+ * keyed by the 64-bit hashes of both strings (which are also seeded with
+ * their lengths), in a direct-mapped table.  Hashing the strings costs
+ * less than decoding them, but it is a loss when the pairs do not repeat,
+ * hence the table is optional.  With the strings immutable, the pointers
+ * and lengths will do as the keys, which keeps the pointer hits in
+ * the cache free of hashing; the table is then cleared whenever the flag
+ * changes, since the pointers may have been freed meanwhile.
+ */
+struct memo {
+    uint64_t k1, k2;
+    int cmp;
+};
+
+#define MEMO_ENV "RPMSETCMP_MEMO"
+
+static inline struct memo *memo_slot(struct memo *memo, unsigned mask,
+				     uint64_t k1, uint64_t k2)
+{
+    return &memo[(k1 ^ (k2 * 0x9E3779B97F4A7C15ULL)) >> 32 & mask];
+}
+
+/* Nonzero, since the pointer is not null. */
+static inline uint64_t memo_key(const char *s, int len, bool immutable)
+{
+    if (immutable)
+	return ((uintptr_t) s ^ (uint64_t) len << 48) * 0x9E3779B97F4A7C15ULL;
+    return hash64(s, len, 0);
 }
 
+/* The context holds the cache, so that each thread can have its own. */
+struct rpmsetcmpCtx {
+    struct cache cache;
+    struct memo *memo;
+    unsigned memo_mask;
+};
+
+/* The default context, used by rpmsetcmp. */
+static struct rpmsetcmpCtx ctx0;
+
 #include <stdio.h>
 static __attribute__((destructor)) void print_stats(void)
 {
-    fprintf(stderr, "rpmsetcmp cache %.1f%% hit rate\n",
-	    100.0 * stats.hit / (stats.hit + stats.miss));
+    if (!stats_env)
+	return;
+    struct stats *stats = &ctx0.cache.stats;
+    fprintf(stderr, "rpmsetcmp %lu calls\n", stats->calls);
+    if (stats->hit + stats->miss)
+	fprintf(stderr, "rpmsetcmp cache %.1f%% hit rate\n",
+		100.0 * stats->hit / (stats->hit + stats->miss));
+    if (stats->dhit + stats->dmiss)
+	fprintf(stderr, "rpmsetcmp cache %.1f%% downsampled hit rate\n",
+		100.0 * stats->dhit / (stats->dhit + stats->dmiss));
+    if (stats->shared)
+	fprintf(stderr, "rpmsetcmp shared cache %.1f%% hit rate\n",
+		100.0 * stats->shared / (stats->miss + stats->dmiss));
+    if (stats->store)
+	fprintf(stderr, "rpmsetcmp store %.1f%% hit rate\n",
+		100.0 * stats->store / stats->miss);
+    if (stats->preload)
+	fprintf(stderr, "rpmsetcmp preload %lu hits\n", stats->preload);
+    if (stats->bloom + stats->bloomfp)
+	fprintf(stderr, "rpmsetcmp filter %lu rejects, %.1f%% false positives\n",
+		stats->bloom, 100.0 * stats->bloomfp / (stats->bloom + stats->bloomfp));
+    if (ctx0.memo)
+	fprintf(stderr, "rpmsetcmp memo %.1f%% hit rate\n",
+		100.0 * stats->memo / stats->calls);
+    fprintf(stderr, "rpmsetcmp cache %lu evictions, %zu bytes resident\n",
+	    stats->evict, ctx0.cache.bytes);
+    fprintf(stderr, "rpmsetcmp shared cache %zu bytes resident\n", S.bytes);
+    fprintf(stderr, "rpmsetcmp decode %llu cycles\n",
+	    (unsigned long long) stats->cycles);
+    for (int k = 1; k < 32; k++)
+	if (stats->ds[k])
+	    fprintf(stderr, "rpmsetcmp downsample by %d bits %lu times\n",
+		    k, stats->ds[k]);
+    fprintf(stderr, "rpmsetcmp Requires %lu on stack, %lu in scratch\n",
+	    stats->stack, stats->scratch);
+    fprintf(stderr, "rpmsetcmp scratch %zu bytes, grown %lu times\n",
+	    ctx0.cache.scratch_size * sizeof(unsigned), stats->grow);
 }
 
-/* The real cache.  You can make it __thread. */
-static struct cache C;
-
 /* Decode small Provides version without caching.
  * Merely touching the cache is relatively expensive; also,
  * the existing cache entries should not be discarded too easily. */
@@ -501,16 +2531,25 @@ static struct cache C;
 /* API */
 #include "rpmsetcmp.h"
 
-int rpmsetcmp(const char *s1, const char *s2)
+/* What the final continuation should compute. */
+enum {
+    SETCMP_CMP,		/* full comparison, as in setcmp() */
+    SETCMP_SUBSET,	/* only whether set2 is a subset of set1 */
+    SETCMP_DETAIL,	/* full comparison with counts */
+};
+
+/* The workhorse, the mode is expected to be constant-folded. */
+static inline __attribute__((always_inline))
+int rpmsetcmp0(struct rpmsetcmpCtx *ctx,
+	       const char *s1, int len1, const char *s2, int len2,
+	       int mode, struct rpmsetcmpCounts *cnt)
 {
     // initialize decoding
     int bpp1;
-    int len1 = strlen(s1);
     int n1 = rpmssDecodeInit(s1, len1, &bpp1);
     if (n1 < 0)
 	return -11;
     int bpp2;
-    int len2 = strlen(s2);
     int n2 = rpmssDecodeInit(s2, len2, &bpp2);
     if (n2 < 0)
 	return -12;
@@ -518,11 +2557,21 @@ int rpmsetcmp(const char *s1, const char *s2)
     /* Unknown error, cannot happen. */
     int cmp = -13;
 
+    /* The filter of cached Provides. */
+    const uint64_t *bloom1 = NULL;
+
     /* This is the final continuation; v1[] and v2[] names
      * are not known yet, but their sizes are n1 and n2. */
 #define SETCMP(v1, v2)					\
     do {						\
-	cmp = setcmp(v1, n1, v2, n2);			\
+	if (mode == SETCMP_DETAIL)			\
+	    cmp = setcmp_detail(v1, n1, v2, n2, cnt);	\
+	else if (mode == SETCMP_SUBSET)			\
+	    cmp = setsubset(v1, n1, v2, n2);		\
+	else if (PARALLEL_PAYS(n1, n2))			\
+	    cmp = setcmp_parallel(v1, n1, v2, n2);	\
+	else						\
+	    cmp = setcmp(v1, n1, v2, n2);		\
     } while (0)
 
     /* Decoding Provides has some asymmetries: cache_decode
@@ -532,21 +2581,26 @@ int rpmsetcmp(const char *s1, const char *s2)
     do {						\
         if (n1 >= DECODE_CACHE_SIZE) {			\
 	    const unsigned *v1;				\
-	    n1 = cache_decode(&C, s1, len1, n1, &v1);	\
+	    n1 = cache_decode(&ctx->cache, s1, len1, bpp1, n1, &v1, &bloom1); \
 	    if (n1 <= 0) {				\
 		cmp = -11;				\
 		break;					\
 	    }						\
 	    NEXTC;					\
-        } else {					\
-	    unsigned v1[n1 + SENTINELS];		\
-	    n1 = rpmssDecode(s1, v1);			\
-	    if (n1 <= 0) {				\
-		cmp = -11;				\
-		break;					\
-	    }						\
-	    NEXT;					\
+        } else						\
+	    DECODE_PROVIDES_STACK(SENTINELS, NEXT);	\
+    } while (0)
+
+    /* Smaller Provides are decoded on the stack. */
+#define DECODE_PROVIDES_STACK(SENTINELS, NEXT)		\
+    do {						\
+	unsigned v1[n1 + SENTINELS];			\
+	n1 = stats_decode(&ctx->cache, s1, v1);		\
+	if (n1 <= 0) {					\
+	    cmp = -11;					\
+	    break;					\
 	}						\
+	NEXT;						\
     } while (0)
 
     /* Pass SENTINELS or NO_SENTINELS to be used in NEXT. */
@@ -556,25 +2610,38 @@ int rpmsetcmp(const char *s1, const char *s2)
 #define DECODE_PROVIDES(SENTINELS, NEXT)		\
 	DECODE_PROVIDES2(SENTINELS, NEXT, NEXT)
 
-    /* Simplify v[] array allocation. */
-#define vmalloc(n) xmalloc((n) * sizeof(unsigned))
+    /* Big Requires, which may also be downsampled, need the scratch
+     * buffer; cache_downsample reserves its own, and small Provides
+     * are decoded on the stack. */
+    if (n2 > DECODE_STACK_SIZE)
+	scratch_reserve(&ctx->cache, n2 + DOWNSAMPLE_SCRATCH(n2));
+
+    /* Simplify v[] array allocation, the buffers are given back
+     * by restoring the mark. */
+#define vmalloc(n) (ctx->cache.scratch_used += (n),	\
+		    ctx->cache.scratch + ctx->cache.scratch_used - (n))
+#define vmark(w) size_t w##_mark = ctx->cache.scratch_used
+#define vfree(w) (ctx->cache.scratch_used = w##_mark)
 
     /* Decoding Requires is always symmetrical. */
 #define DECODE_REQUIRES(NEXT)				\
     do {						\
         if (n2 > DECODE_STACK_SIZE) {			\
+	    vmark(v2);					\
 	    unsigned *v2 = vmalloc(n2);			\
-	    n2 = rpmssDecode(s2, v2);			\
+	    ctx->cache.stats.scratch++;			\
+	    n2 = stats_decode(&ctx->cache, s2, v2);	\
 	    if (n2 <= 0) {				\
-		free(v2);				\
+		vfree(v2);				\
 		cmp = -12;				\
 		break;					\
 	    }						\
 	    NEXT;					\
-	    free(v2);					\
+	    vfree(v2);					\
         } else {					\
 	    unsigned v2[n2];				\
-	    n2 = rpmssDecode(s2, v2);			\
+	    ctx->cache.stats.stack++;			\
+	    n2 = stats_decode(&ctx->cache, s2, v2);	\
 	    if (n2 <= 0) {				\
 		cmp = -12;				\
 		break;					\
@@ -591,12 +2658,29 @@ int rpmsetcmp(const char *s1, const char *s2)
 	NEXT;						\
     } while (0)
 
+    /* With the filter, an element of Requires can be found missing before
+     * the merge.  Then, if Provides are no smaller, the sets are not equal
+     * and neither is a subset of the other.  Otherwise, the filter turns
+     * out to be useless, when the merge finds a missing element. */
+#define PREFILTER(NEXT)					\
+    do {						\
+	bool filtered = bloom1 && mode != SETCMP_DETAIL && n1 >= n2; \
+	if (filtered && bloom_reject(bloom1, n1, v2, n2)) { \
+	    ctx->cache.stats.bloom++;			\
+	    cmp = mode == SETCMP_SUBSET ? 0 : -2;	\
+	    break;					\
+	}						\
+	NEXT;						\
+	if (filtered && (mode == SETCMP_SUBSET ? cmp == 0 : cmp < 0)) \
+	    ctx->cache.stats.bloomfp++;			\
+    } while (0)
+
     /* Now we're ready to handle the simple case
      * in which downsampling is not needed. */
     if (bpp1 == bpp2) {
 	DECODE_PROVIDES2(SENTINELS,
 	    /* cache has sentinels */
-		DECODE_REQUIRES(SETCMP(v1, v2)),
+		DECODE_REQUIRES(PREFILTER(SETCMP(v1, v2))),
 	    INSTALL_SENTINELS(v1,
 		DECODE_REQUIRES(SETCMP(v1, v2))));
 	return cmp;
@@ -607,96 +2691,753 @@ int rpmsetcmp(const char *s1, const char *s2)
 #define ALLOC(w, n, NEXT)				\
     do {						\
 	if (n > DECODE_STACK_SIZE) {			\
+	    vmark(w);					\
 	    unsigned *w = vmalloc(n);			\
 	    NEXT;					\
-	    free(w);					\
+	    vfree(w);					\
         } else {					\
 	    unsigned w[n];				\
 	    NEXT;					\
 	}						\
     } while (0)
 
-    /* Downsample either Provides or Requires. */
-#define DOWNSAMPLE1(v, n, w, bpp, NEXT)			\
+    /* Big Provides against a few Requires can do without downsampling,
+     * unless the exact size of downsampled Provides is needed. */
+#define PROBE(v1, v2)					\
     do {						\
-	n = downsample1(v, n, w, bpp);			\
-	NEXT;						\
+	cmp = setcmp_probe(v1, n1, v2, n2,		\
+		bpp2, bpp1 - bpp2, mode == SETCMP_SUBSET); \
     } while (0)
-
-    /* Now can handle two more cases. */
-    if (bpp1 == bpp2 + 1) {
+    if (bpp1 > bpp2 && mode != SETCMP_DETAIL &&
+	    probe_pays(n1, n2, bpp1 - bpp2)) {
 	DECODE_PROVIDES(NO_SENTINELS,
-	    ALLOC(w, n1 + SENTINELS,
-		DOWNSAMPLE1(v1, n1, w, bpp2,
-		    INSTALL_SENTINELS(w,
-			DECODE_REQUIRES(SETCMP(w, v2))))));
+	    DECODE_REQUIRES(PROBE(v1, v2)));
 	return cmp;
     }
-    if (bpp2 == bpp1 + 1) {
-	DECODE_PROVIDES2(SENTINELS,
-	    /* cache has sentinels */
-DECODE_REQUIRES(ALLOC(w, n2, DOWNSAMPLE1(v2, n2, w, bpp1, SETCMP(v1, w)))),
-	    INSTALL_SENTINELS(v1,
-DECODE_REQUIRES(ALLOC(w, n2, DOWNSAMPLE1(v2, n2, w, bpp1, SETCMP(v1, w))))));
+
+    /* Big Provides are downsampled once, then served from the cache. */
+    if (bpp1 > bpp2 && n1 >= DECODE_CACHE_SIZE) {
+	const unsigned *v1;
+	n1 = cache_downsample(&ctx->cache, s1, len1, bpp1, n1, bpp2, &v1, &bloom1);
+	if (n1 <= 0)
+	    return -11;
+	DECODE_REQUIRES(PREFILTER(SETCMP(v1, v2)));
 	return cmp;
     }
 
-    /* Simplify double buffer allocation. */
-#define ALLOC2(w1, w2, n, SENTINELS, NEXT)		\
-	ALLOC(w0, n * 2 + SENTINELS,			\
-	ALLOC2_NEXT(w0, w1, w2, n, NEXT))
-#define ALLOC2_NEXT(w0, w1, w2, n, NEXT)		\
-    do {						\
-	unsigned *w1 = w0;				\
-	unsigned *w2 = w0 + n;				\
-	NEXT;						\
-    } while (0)
-
-    /* Simplify conversion from buffer to pointer. */
-#define RENAME(v, w, NEXT)				\
-    do {						\
-	unsigned *w = v;				\
-	NEXT;						\
-    } while (0)
-
-    /* Downsample either Requires or Provides using w1 and w2
-     * alternate buffers; w1 and w2 must be pointers, they will be
-     * freely exchanged; w2 may point to v; the output is in w1. */
-#define DOWNSAMPLE(v, n, w1, w2, bppG, bppL, NEXT)	\
+    /* Downsample either Provides or Requires in place. */
+#define DOWNSAMPLE(v, n, bppG, bppL, NEXT)		\
     do {						\
-	bppG--;						\
-	n = downsample1(v, n, w1, bppG);		\
-	do {						\
-	    bppG--;					\
-	    n = downsample1(w1, n, w2, bppG);		\
-	    unsigned *wx = w1;				\
-	    w1 = w2;					\
-	    w2 = wx;					\
-	} while (bppG > bppL);				\
+	ctx->cache.stats.ds[bppG - bppL]++;		\
+	ALLOC(s, DOWNSAMPLE_SCRATCH(n),			\
+	    n = downsample_inplace(v, n, s, bppL, bppG - bppL)); \
 	NEXT;						\
     } while (0)
 
-    /* Handle the most difficult cases. */
+    /* Small Provides are downsampled on the stack. */
     if (bpp1 > bpp2) {
-	DECODE_PROVIDES2(SENTINELS,
-	    ALLOC2(w, w2, n1, SENTINELS,
-DOWNSAMPLE(v1, n1, w, w2, bpp1, bpp2, INSTALL_SENTINELS(w, DECODE_REQUIRES(SETCMP(w, v2))))),
-	    ALLOC(w0, n1 + SENTINELS,
-		RENAME(w0, w,
-		    RENAME(v1, w2,
-DOWNSAMPLE(v1, n1, w, w2, bpp1, bpp2, INSTALL_SENTINELS(w, DECODE_REQUIRES(SETCMP(w, v2))))))));
+	DECODE_PROVIDES_STACK(SENTINELS,
+	    DOWNSAMPLE(v1, n1, bpp1, bpp2,
+		INSTALL_SENTINELS(v1,
+		    DECODE_REQUIRES(SETCMP(v1, v2)))));
 	return cmp;
     }
 
     /* bpp2 > bpp1 */
-    {
-	DECODE_PROVIDES2(SENTINELS,
-	    /* cache has sentinels */
-DECODE_REQUIRES(ALLOC(w0, n2, RENAME(w0, w, RENAME(v2, w2, DOWNSAMPLE(v2, n2, w, w2, bpp2, bpp1, SETCMP(v1, w)))))),
-	    INSTALL_SENTINELS(v1,
-DECODE_REQUIRES(ALLOC(w0, n2, RENAME(w0, w, RENAME(v2, w2, DOWNSAMPLE(v2, n2, w, w2, bpp2, bpp1, SETCMP(v1, w))))))));
+    DECODE_PROVIDES2(SENTINELS,
+	/* cache has sentinels */
+	    DECODE_REQUIRES(DOWNSAMPLE(v2, n2, bpp2, bpp1,
+		PREFILTER(SETCMP(v1, v2)))),
+	INSTALL_SENTINELS(v1,
+	    DECODE_REQUIRES(DOWNSAMPLE(v2, n2, bpp2, bpp1, SETCMP(v1, v2)))));
+    return cmp;
+}
+
+/* The memo only keeps full comparisons, which also answer SETCMP_SUBSET. */
+static inline __attribute__((always_inline))
+int rpmsetcmp1(struct rpmsetcmpCtx *ctx,
+	       const char *s1, int len1, const char *s2, int len2,
+	       int mode, struct rpmsetcmpCounts *cnt)
+{
+    ctx->cache.stats.calls++;
+    if (ctx->memo == NULL || mode == SETCMP_DETAIL) {
+	int cmp = rpmsetcmp0(ctx, s1, len1, s2, len2, mode, cnt);
+	scratch_trim(&ctx->cache);
 	return cmp;
     }
+    uint64_t k1 = memo_key(s1, len1, ctx->cache.immutable);
+    uint64_t k2 = memo_key(s2, len2, ctx->cache.immutable);
+    struct memo *m = memo_slot(ctx->memo, ctx->memo_mask, k1, k2);
+    if (m->k1 == k1 && m->k2 == k2) {
+	ctx->cache.stats.memo++;
+	return mode == SETCMP_SUBSET ? m->cmp >= 0 : m->cmp;
+    }
+    int cmp = rpmsetcmp0(ctx, s1, len1, s2, len2, mode, cnt);
+    scratch_trim(&ctx->cache);
+    if (mode == SETCMP_CMP && cmp >= -2)
+	*m = (struct memo) { k1, k2, cmp };
+    return cmp;
+}
+
+int rpmsetcmp(const char *s1, const char *s2)
+{
+    return rpmsetcmp1(&ctx0, s1, strlen(s1), s2, strlen(s2), SETCMP_CMP, NULL);
+}
+
+#include <limits.h>
+
+/* The lengths are known, only the prefix needs to be checked. */
+static inline const char *strip_prefix(const char *s, size_t *len)
+{
+    if (*len >= 4 && memcmp(s, "set:", 4) == 0) {
+	*len -= 4;
+	return s + 4;
+    }
+    return s;
+}
+
+/* The decoder reads up to the null byte, while the buffers are sized
+ * by the length, so the two must agree. */
+int rpmsetcmpCtxN(struct rpmsetcmpCtx *ctx,
+		  const char *s1, size_t len1, const char *s2, size_t len2)
+{
+    s1 = strip_prefix(s1, &len1);
+    s2 = strip_prefix(s2, &len2);
+    if (len1 > INT_MAX || s1[len1] != '\0')
+	return -11;
+    if (len2 > INT_MAX || s2[len2] != '\0')
+	return -12;
+    return rpmsetcmp1(ctx, s1, len1, s2, len2, SETCMP_CMP, NULL);
+}
+
+int rpmsetcmpN(const char *s1, size_t len1, const char *s2, size_t len2)
+{
+    return rpmsetcmpCtxN(&ctx0, s1, len1, s2, len2);
+}
+
+struct rpmsetcmpCtx *rpmsetcmpCtxNew(void)
+{
+    struct rpmsetcmpCtx *ctx = xmalloc(sizeof *ctx);
+    memset(ctx, 0, sizeof *ctx);
+    return ctx;
+}
+
+struct rpmsetcmpCtx *rpmsetcmpCtxFree(struct rpmsetcmpCtx *ctx)
+{
+    if (ctx) {
+	cache_free(&ctx->cache);
+	free(ctx->memo);
+	free(ctx);
+    }
+    return NULL;
+}
+
+void rpmsetcmpCtxBudget(struct rpmsetcmpCtx *ctx, size_t bytes)
+{
+    struct cache *c = ctx ? &ctx->cache : &ctx0.cache;
+    c->budget = bytes;
+    c->budget_set = 1;
+    while (c->budget && c->hc && c->bytes > c->budget)
+	cache_evict(c, cache_victim(c));
+}
+
+void rpmsetcmpSharedBudget(size_t bytes)
+{
+    pthread_mutex_lock(&S.lock);
+    S.budget = bytes;
+    S.budget_set = 1;
+    while (S.budget && S.count && S.bytes > S.budget)
+	shared_evict();
+    shared_reclaim();
+    pthread_mutex_unlock(&S.lock);
+}
+
+int rpmsetcmpCtxMemo(struct rpmsetcmpCtx *ctx, size_t size)
+{
+    if (ctx == NULL)
+	ctx = &ctx0;
+    free(ctx->memo);
+    ctx->memo = NULL;
+    ctx->memo_mask = 0;
+    if (size == 0)
+	return 0;
+    size_t n = 1;
+    while (n < size && n < 1U << 31)
+	n *= 2;
+    // the empty slots have zero keys, which no pair is expected to hash to
+    ctx->memo = calloc(n, sizeof *ctx->memo);
+    if (ctx->memo == NULL)
+	return -1;
+    ctx->memo_mask = n - 1;
+    return 0;
+}
+
+static __attribute__((constructor)) void init_memo(void)
+{
+    const char *s = getenv(MEMO_ENV);
+    if (s && *s)
+	rpmsetcmpCtxMemo(NULL, strtoul(s, NULL, 10));
+}
+
+void rpmsetcmpCtxImmutable(struct rpmsetcmpCtx *ctx, int immutable)
+{
+    if (ctx == NULL)
+	ctx = &ctx0;
+    struct cache *c = &ctx->cache;
+    // forget the pointers which might have been freed meanwhile
+    if (immutable && !c->immutable)
+	for (int i = 0; i < c->hc; i++)
+	    c->ev[i].ptr = NULL;
+    // the memo keys change from hashes to pointers or back
+    if (!immutable != !c->immutable && ctx->memo)
+	memset(ctx->memo, 0, (ctx->memo_mask + 1) * sizeof *ctx->memo);
+    c->immutable = immutable;
+}
+
+void rpmsetcmpStats(struct rpmsetcmpCtx *ctx, struct rpmsetcmpStats *st)
+{
+    struct cache *c = ctx ? &ctx->cache : &ctx0.cache;
+    struct stats *stats = &c->stats;
+    __atomic_store_n(&stats_cycles, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&S.lock);
+    size_t shared_bytes = S.bytes;
+    pthread_mutex_unlock(&S.lock);
+    *st = (struct rpmsetcmpStats) {
+	.calls = stats->calls,
+	.hits = stats->hit + stats->dhit,
+	.misses = stats->miss + stats->dmiss,
+	.shared = stats->shared,
+	.store = stats->store,
+	.preloaded = stats->preload,
+	.memo = stats->memo,
+	.filtered = stats->bloom,
+	.evictions = stats->evict,
+	.bytes = c->bytes,
+	.shared_bytes = shared_bytes,
+	.cycles = stats->cycles,
+	.stack = stats->stack,
+	.scratch = stats->scratch,
+	.grow = stats->grow,
+    };
+    memcpy(st->downsample, stats->ds, sizeof st->downsample);
+}
+
+int rpmsetcmpCtx(struct rpmsetcmpCtx *ctx, const char *s1, const char *s2)
+{
+    return rpmsetcmp1(ctx, s1, strlen(s1), s2, strlen(s2), SETCMP_CMP, NULL);
+}
+
+int rpmsetSatisfies(const char *s1, const char *s2)
+{
+    return rpmsetcmp1(&ctx0, s1, strlen(s1), s2, strlen(s2),
+		      SETCMP_SUBSET, NULL);
+}
+
+int rpmsetcmpDetail(const char *s1, const char *s2,
+		    struct rpmsetcmpCounts *cnt)
+{
+    return rpmsetcmp1(&ctx0, s1, strlen(s1), s2, strlen(s2),
+		      SETCMP_DETAIL, cnt);
+}
+
+int rpmsetcmpv(const unsigned *v1, int n1, const unsigned *v2, int n2)
+{
+    if (n1 < 0 || n2 < 0)
+	return -13;
+    return setcmp_nosentinels(v1, n1, v2, n2);
+}
+
+/*
+ * A handle is a decoded set, with sentinels, which is held by the caller
+ * rather than by the cache.  The set downsampled to a smaller bpp is kept
+ * along with it, on the list of such sets, which only grows.
+ */
+struct rpmsetHandle {
+    int refs;
+    int bpp;
+    int n;
+    struct rpmsetHandle *down;
+    unsigned v[];
+};
+
+static struct rpmsetHandle *handle_alloc(int bpp, int n)
+{
+    struct rpmsetHandle *h = xmalloc(sizeof *h +
+				     (n + SENTINELS) * sizeof(unsigned));
+    if (h) {
+	h->refs = 1;
+	h->bpp = bpp;
+	h->n = n;
+	h->down = NULL;
+    }
+    return h;
+}
+
+struct rpmsetHandle *rpmsetDecodeHandle(const char *s)
+{
+    int bpp;
+    int n = rpmssDecodeInit(s, strlen(s), &bpp);
+    if (n < 0)
+	return NULL;
+    struct rpmsetHandle *h = handle_alloc(bpp, n);
+    if (h == NULL)
+	return NULL;
+    h->n = rpmssDecode(s, h->v);
+    if (h->n <= 0) {
+	free(h);
+	return NULL;
+    }
+    install_sentinels(h->v, h->n);
+    return h;
+}
+
+struct rpmsetHandle *rpmsetHandleLink(struct rpmsetHandle *h)
+{
+    if (h)
+	__atomic_add_fetch(&h->refs, 1, __ATOMIC_RELAXED);
+    return h;
+}
+
+struct rpmsetHandle *rpmsetHandleFree(struct rpmsetHandle *h)
+{
+    if (h && __atomic_sub_fetch(&h->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+	struct rpmsetHandle *d = h->down;
+	while (d) {
+	    struct rpmsetHandle *next = d->down;
+	    free(d);
+	    d = next;
+	}
+	free(h);
+    }
+    return NULL;
+}
+
+/* The set downsampled to bpp, made on first use.  Two threads may race
+ * to make the same set, in which case the loser's copy is discarded. */
+static const struct rpmsetHandle *handle_down(struct rpmsetHandle *h, int bpp)
+{
+    struct rpmsetHandle *d = __atomic_load_n(&h->down, __ATOMIC_ACQUIRE);
+    for (struct rpmsetHandle *e = d; e; e = e->down)
+	if (e->bpp == bpp)
+	    return e;
+    struct rpmsetHandle *w = handle_alloc(bpp, h->n);
+    if (w == NULL)
+	return NULL;
+    size_t n = downsample1(h->v, h->n, w->v, h->bpp - 1);
+    if (h->bpp - 1 > bpp) {
+	unsigned *s = xmalloc(DOWNSAMPLE_SCRATCH(n) * sizeof(unsigned));
+	if (s == NULL) {
+	    free(w);
+	    return NULL;
+	}
+	n = downsample_inplace(w->v, n, s, bpp, h->bpp - 1 - bpp);
+	free(s);
+    }
+    w->n = n;
+    install_sentinels(w->v, n);
+    w->down = d;
+    while (!__atomic_compare_exchange_n(&h->down, &w->down, w, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	for (struct rpmsetHandle *e = w->down; e; e = e->down)
+	    if (e->bpp == bpp) {
+		free(w);
+		return e;
+	    }
+    return w;
+}
+
+int rpmsetcmpHandles(struct rpmsetHandle *h1, struct rpmsetHandle *h2)
+{
+    if (h1 == NULL)
+	return -11;
+    if (h2 == NULL)
+	return -12;
+    const struct rpmsetHandle *d1 = h1, *d2 = h2;
+    if (h1->bpp > h2->bpp && (d1 = handle_down(h1, h2->bpp)) == NULL)
+	return -13;
+    if (h2->bpp > h1->bpp && (d2 = handle_down(h2, h1->bpp)) == NULL)
+	return -13;
+    if (PARALLEL_PAYS(d1->n, d2->n))
+	return setcmp_parallel(d1->v, d1->n, d2->v, d2->n);
+    return setcmp(d1->v, d1->n, d2->v, d2->n);
+}
+
+/* Only the sets which would be cached are kept in the store. */
+int rpmsetcmpStoreBuild(const char *path, const char *const *sv, int n)
+{
+    struct store_hdr hdr = { STORE_MAGIC, SENTINELS, 16, 0, 0 };
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+	int bpp;
+	if (rpmssDecodeInit(sv[i], strlen(sv[i]), &bpp) >= DECODE_CACHE_SIZE)
+	    count++;
+    }
+    while (hdr.nslots < 2 * (uint32_t) count + 1)
+	hdr.nslots *= 2;
+    size_t mask = hdr.nslots - 1;
+    struct store_slot *slot = calloc(hdr.nslots, sizeof *slot);
+    if (slot == NULL)
+	return -1;
+    // place the sets, duplicates are skipped
+#define STORE_ROUND(off) \
+	(((off) + STORE_ALIGN - 1) & ~(uint64_t) (STORE_ALIGN - 1))
+    uint64_t off = STORE_ROUND(sizeof hdr + hdr.nslots * sizeof *slot);
+    for (int i = 0; i < n; i++) {
+	int bpp, len = strlen(sv[i]);
+	int nv = rpmssDecodeInit(sv[i], len, &bpp);
+	if (nv < DECODE_CACHE_SIZE)
+	    continue;
+	uint64_t key[2];
+	hash128(sv[i], len, key);
+	size_t j = key[0] & mask;
+	while (slot[j].key[0] &&
+		(slot[j].key[0] != key[0] || slot[j].key[1] != key[1]))
+	    j = (j + 1) & mask;
+	if (slot[j].key[0])
+	    continue;
+	// n is the upper bound until decoded, the string goes after v[]
+	uint64_t str = off + (nv + SENTINELS) * sizeof(unsigned);
+	slot[j] = (struct store_slot) {
+	    { key[0], key[1] }, len, bpp, nv, i, off, str };
+	off = STORE_ROUND(str + len + 1);
+	hdr.count++;
+    }
+    // write a new file, then rename it
+    size_t tmplen = strlen(path) + sizeof ".XXXXXX";
+    char tmp[tmplen];
+    snprintf(tmp, tmplen, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+	free(slot);
+	return -1;
+    }
+    char *base = MAP_FAILED;
+    if (fchmod(fd, 0644) == 0 && ftruncate(fd, off) == 0)
+	base = mmap(NULL, off, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int rc = -1;
+    if (base != MAP_FAILED) {
+	rc = 0;
+	for (size_t j = 0; j < hdr.nslots; j++) {
+	    if (slot[j].key[0] == 0)
+		continue;
+	    unsigned *v = (unsigned *) (base + slot[j].off);
+	    // the index of the string was kept in the padding
+	    memcpy(base + slot[j].str, sv[slot[j].pad], slot[j].len + 1);
+	    int nv = rpmssDecode(sv[slot[j].pad], v);
+	    if (nv <= 0) {
+		rc = -1;
+		break;
+	    }
+	    install_sentinels(v, nv);
+	    slot[j].n = nv;
+	    slot[j].pad = 0;
+	}
+	memcpy(base, &hdr, sizeof hdr);
+	memcpy(base + sizeof hdr, slot, hdr.nslots * sizeof *slot);
+	if (munmap(base, off))
+	    rc = -1;
+    }
+    if (close(fd))
+	rc = -1;
+    if (rc == 0)
+	rc = rename(tmp, path);
+    if (rc)
+	unlink(tmp);
+    free(slot);
+    return rc;
+}
+
+/* Finds the displacements, for keys[nk] which are unique.  The slots
+ * get the keys; false means that the table should be made bigger. */
+static bool preload_place(struct preload *pl,
+			  const struct store_slot *keys, int nk)
+{
+    size_t nb = pl->bmask + 1;
+    uint32_t *start = calloc(nb + 1, sizeof *start);
+    uint32_t *order = xmalloc((nk + nb) * sizeof *order);
+    uint32_t *bucket = order + nk;
+    size_t *pos = xmalloc(nk * sizeof *pos);
+    bool ok = start && order && pos;
+    if (!ok)
+	goto out;
+    // the keys by bucket
+    for (int i = 0; i < nk; i++)
+	start[(keys[i].key[0] & pl->bmask) + 1]++;
+    for (size_t b = 0; b < nb; b++)
+	start[b + 1] += start[b];
+    for (int i = 0; i < nk; i++)
+	order[start[keys[i].key[0] & pl->bmask]++] = i;
+    for (size_t b = nb; b > 0; b--)
+	start[b] = start[b - 1];
+    start[0] = 0;
+    // the buckets by decreasing size, which are small
+    uint32_t maxsize = 0;
+    for (size_t b = 0; b < nb; b++)
+	if (maxsize < start[b + 1] - start[b])
+	    maxsize = start[b + 1] - start[b];
+    size_t nbk = 0;
+    for (uint32_t size = maxsize; size > 0; size--)
+	for (size_t b = 0; b < nb; b++)
+	    if (start[b + 1] - start[b] == size)
+		bucket[nbk++] = b;
+    for (size_t k = 0; k < nbk && ok; k++) {
+	size_t b = bucket[k];
+	const uint32_t *kv = order + start[b];
+	size_t m = start[b + 1] - start[b];
+	uint32_t d = 0;
+	for (;; d++) {
+	    if (d == 1 << 20) {
+		ok = 0;
+		break;
+	    }
+	    size_t i;
+	    for (i = 0; i < m; i++) {
+		pos[i] = preload_pos(keys[kv[i]].key[1], d, pl->mask);
+		if (pl->slot[pos[i]].key[0])
+		    break;
+		size_t j;
+		for (j = 0; j < i; j++)
+		    if (pos[j] == pos[i])
+			break;
+		if (j < i)
+		    break;
+	    }
+	    if (i == m)
+		break;
+	}
+	if (!ok)
+	    break;
+	pl->disp[b] = d;
+	for (size_t i = 0; i < m; i++)
+	    pl->slot[pos[i]] = keys[kv[i]];
+    }
+out:
+    free(start);
+    free(order);
+    free(pos);
+    return ok;
+}
+
+/* The sets are decoded in chunks, taken in turn by the threads. */
+struct preload_work {
+    struct preload *pl;
+    const char *const *sv;
+    size_t next;
+};
+
+#define PRELOAD_CHUNK 16
+
+static void *preload_decode(void *arg)
+{
+    struct preload_work *w = arg;
+    struct preload *pl = w->pl;
+    size_t nslots = (size_t) pl->mask + 1;
+    while (1) {
+	size_t i = __atomic_fetch_add(&w->next, PRELOAD_CHUNK, __ATOMIC_RELAXED);
+	if (i >= nslots)
+	    break;
+	size_t end = i + PRELOAD_CHUNK < nslots ? i + PRELOAD_CHUNK : nslots;
+	for (; i < end; i++) {
+	    struct store_slot *slot = &pl->slot[i];
+	    if (slot->key[0] == 0)
+		continue;
+	    unsigned *v = (unsigned *) (pl->arena + slot->off);
+	    // the index of the string was kept in the padding
+	    memcpy(pl->arena + slot->str, w->sv[slot->pad], slot->len + 1);
+	    int n = rpmssDecode(w->sv[slot->pad], v);
+	    if (n <= 0) {
+		// the slot is emptied, the string is left to rpmsetcmp
+		slot->key[0] = 0;
+		continue;
+	    }
+	    install_sentinels(v, n);
+	    slot->n = n;
+	    slot->pad = 0;
+	}
+    }
+    return NULL;
+}
+
+static struct preload *preload_build(const char *const *sv, int n)
+{
+    // unique keys, in a transient open-addressed table
+    size_t nt = 16;
+    while (nt < 2 * (size_t) n + 1)
+	nt *= 2;
+    struct store_slot *tab = calloc(nt, sizeof *tab);
+    struct store_slot *keys = xmalloc(n * sizeof *keys);
+    struct preload *pl = calloc(1, sizeof *pl);
+    if (!tab || !keys || !pl)
+	goto err;
+    int nk = 0;
+    uint64_t off = 0;
+    for (int i = 0; i < n; i++) {
+	int bpp, len = strlen(sv[i]);
+	int nv = rpmssDecodeInit(sv[i], len, &bpp);
+	if (nv < DECODE_CACHE_SIZE)
+	    continue;
+	uint64_t key[2];
+	hash128(sv[i], len, key);
+	size_t j = key[0] & (nt - 1);
+	while (tab[j].key[0] && (tab[j].key[0] != key[0] || tab[j].key[1] != key[1]))
+	    j = (j + 1) & (nt - 1);
+	if (tab[j].key[0])
+	    continue;
+	// n is the upper bound until decoded, the string goes after v[]
+	uint64_t str = off + (nv + SENTINELS) * sizeof(unsigned);
+	tab[j] = keys[nk++] = (struct store_slot) {
+	    { key[0], key[1] }, len, bpp, nv, i, off, str };
+	off = STORE_ROUND(str + len + 1);
+    }
+    free(tab);
+    tab = NULL;
+    // about four keys per bucket, and the slots 80% full at most
+    size_t nb = 1, ns = 16;
+    while (nb * 4 < (size_t) nk)
+	nb *= 2;
+    while (ns * 4 < (size_t) nk * 5)
+	ns *= 2;
+    for (;; ns *= 2) {
+	pl->mask = ns - 1;
+	pl->bmask = nb - 1;
+	pl->disp = calloc(nb, sizeof *pl->disp);
+	pl->slot = calloc(ns, sizeof *pl->slot);
+	if (!pl->disp || !pl->slot)
+	    goto err;
+	if (preload_place(pl, keys, nk))
+	    break;
+	free(pl->disp);
+	free(pl->slot);
+	pl->disp = NULL;
+	pl->slot = NULL;
+	if (ns > 4 * (size_t) nk + 16)
+	    goto err;
+    }
+    free(keys);
+    keys = NULL;
+    pl->count = nk;
+    pl->arena = aligned_alloc(STORE_ALIGN, off ? off : STORE_ALIGN);
+    if (pl->arena == NULL)
+	goto err;
+    // decode, in this thread and a few more
+    struct preload_work w = { pl, sv, 0 };
+    size_t nthr = nk / (4 * PRELOAD_CHUNK);
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > 0 && nthr > (size_t) ncpu)
+	nthr = ncpu;
+    if (nthr > PARALLEL_MAXTHREADS)
+	nthr = PARALLEL_MAXTHREADS;
+    pthread_t tv[PARALLEL_MAXTHREADS];
+    bool started[PARALLEL_MAXTHREADS];
+    for (size_t t = 1; t < nthr; t++)
+	started[t] = pthread_create(&tv[t], NULL, preload_decode, &w) == 0;
+    preload_decode(&w);
+    for (size_t t = 1; t < nthr; t++)
+	if (started[t])
+	    pthread_join(tv[t], NULL);
+    // less the strings which failed to decode
+    for (size_t i = 0; i <= pl->mask; i++)
+	if (pl->slot[i].key[0] == 0 && pl->slot[i].len)
+	    pl->count--;
+    return pl;
+err:
+    free(tab);
+    free(keys);
+    preload_free(pl);
+    return NULL;
+}
+
+int rpmsetPreload(const char *const *sv, int n)
+{
+    struct preload *pl = NULL;
+    if (n > 0 && (pl = preload_build(sv, n)) == NULL)
+	return -1;
+    // no index, rather than one which is never hit
+    if (pl && pl->count == 0) {
+	preload_free(pl);
+	pl = NULL;
+    }
+    preload_free(__atomic_exchange_n(&PL, pl, __ATOMIC_ACQ_REL));
+    return pl ? pl->count : 0;
+}
+
+/*
+ * The Provides which are going to be compared next can be decoded ahead,
+ * on a helper thread, while the caller does its own work.  The helper
+ * only publishes the sets to the shared cache, where the caller finds
+ * them on a miss; its own cache holds no entries, and only registers
+ * it as a reader of the shared cache.  The preloaded index is checked
+ * by the caller, since it may be replaced while the helper is busy.
+ * The strings are copied, in case the caller frees them; when the queue
+ * is full, the hints are dropped.
+ */
+#define PREFETCH_QUEUE 16
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *q[PREFETCH_QUEUE];
+    unsigned head, tail;
+    bool started;
+    struct cache reader;
+} PF = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static pthread_once_t prefetch_once = PTHREAD_ONCE_INIT;
+
+static void *prefetch_thread(void *arg)
+{
+    (void) arg;
+    while (1) {
+	pthread_mutex_lock(&PF.lock);
+	while (PF.head == PF.tail)
+	    pthread_cond_wait(&PF.cond, &PF.lock);
+	char *s = PF.q[PF.tail++ % PREFETCH_QUEUE];
+	pthread_mutex_unlock(&PF.lock);
+	int bpp, len = strlen(s);
+	int n = rpmssDecodeInit(s, len, &bpp);
+	struct cache_ent *ent = shared_decode(&PF.reader, s, len, bpp, &n);
+	if (ent)
+	    ent_put(ent);
+	free(s);
+    }
+    return NULL;
+}
+
+static void prefetch_start(void)
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    if (pthread_attr_init(&attr))
+	return;
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    PF.started = pthread_create(&tid, &attr, prefetch_thread, NULL) == 0;
+    pthread_attr_destroy(&attr);
+}
+
+void rpmsetcmpPrefetch(const char *s)
+{
+    // only the sets which would be cached
+    int bpp, len = strlen(s);
+    int n = rpmssDecodeInit(s, len, &bpp);
+    if (n < DECODE_CACHE_SIZE || preload_lookup(s, len, bpp, &n))
+	return;
+    pthread_once(&prefetch_once, prefetch_start);
+    if (!PF.started)
+	return;
+    // the decoder reads two bytes at a time
+    char *copy = xmalloc(len + 2);
+    if (copy == NULL)
+	return;
+    memcpy(copy, s, len);
+    copy[len] = copy[len + 1] = '\0';
+    pthread_mutex_lock(&PF.lock);
+    if (PF.head - PF.tail < PREFETCH_QUEUE) {
+	PF.q[PF.head++ % PREFETCH_QUEUE] = copy;
+	copy = NULL;
+	pthread_cond_signal(&PF.cond);
+    }
+    pthread_mutex_unlock(&PF.lock);
+    free(copy);
 }
 
 // ex: set ts=8 sts=4 sw=4 noet:
@@ -1,6 +1,8 @@
 #ifndef RPMSETCMP_H_
 #define RPMSETCMP_H_
 
+#include <stddef.h>
+
 /*
  * Compare two set-versions.
  * @return
@@ -8,11 +10,198 @@
  *  0: set1 ==  set2
  * -1: set1  <  set2
  * -2: set1 !=  set2 (possibly with common elements)
- * -3: set1 !=  set2 (disjoint sets)
+ * -3: set1 !=  set2 (disjoint sets, only reported by rpmsetcmpDetail)
  * -11: set1 decoder error
  * -12: set2 decoder error
  * For performance reasons, set1 should come on behalf of Provides.
  */
 int rpmsetcmp(const char *s1, const char *s2);
 
+/*
+ * Same as rpmsetcmp, for callers which know the lengths of the strings,
+ * so that they are not scanned again; also, an optional "set:" prefix
+ * is stripped.  The strings must still be null-terminated right at len,
+ * i.e. len must be exactly strlen, or else the string is reported as
+ * a decoder error.
+ */
+int rpmsetcmpN(const char *s1, size_t len1, const char *s2, size_t len2);
+
+/*
+ * A set-version decoded once and held by the caller, which can then be
+ * compared any number of times at the cost of the merge alone.  The sets
+ * downsampled for the comparisons are kept along with the handle.  A handle
+ * can be shared by threads; rpmsetHandleLink takes another reference,
+ * and rpmsetHandleFree drops one.
+ * @return the handle, NULL on decoder error
+ */
+struct rpmsetHandle *rpmsetDecodeHandle(const char *s);
+struct rpmsetHandle *rpmsetHandleLink(struct rpmsetHandle *h);
+struct rpmsetHandle *rpmsetHandleFree(struct rpmsetHandle *h);
+
+/*
+ * Compare two decoded set-versions, h1 on behalf of Provides.
+ * @return same as rpmsetcmp, -11 or -12 for a NULL handle,
+ *         -13 if out of memory
+ */
+int rpmsetcmpHandles(struct rpmsetHandle *h1, struct rpmsetHandle *h2);
+
+/*
+ * Decoded Provides are cached, and the cache is not thread-safe.
+ * rpmsetcmp uses the default cache; threads should instead use
+ * their own contexts, each with an independent cache.
+ */
+struct rpmsetcmpCtx *rpmsetcmpCtxNew(void);
+struct rpmsetcmpCtx *rpmsetcmpCtxFree(struct rpmsetcmpCtx *ctx);
+
+/*
+ * Limit the memory taken by the cache in ctx (NULL means the default
+ * context), in which case the entries are evicted by size and decode cost
+ * rather than by recency; 0 means no limit other than the number of entries.
+ * The default limit is taken from the RPMSETCMP_CACHE_BUDGET environment
+ * variable, in bytes, with an optional K, M or G suffix.
+ */
+void rpmsetcmpCtxBudget(struct rpmsetcmpCtx *ctx, size_t bytes);
+
+/*
+ * Limit the memory taken by the cache shared by all contexts, which
+ * otherwise keeps every entry of the per-context caches alive until it
+ * is evicted from the shared cache, too.  The default limit is 64M, or
+ * taken from the RPMSETCMP_SHARED_BUDGET environment variable.  A set
+ * bigger than either limit is not cached at all.
+ */
+void rpmsetcmpSharedBudget(size_t bytes);
+
+/*
+ * Remember the results of up to size comparisons in ctx (NULL means
+ * the default context), keyed by the hashes of both strings, so that
+ * a pair which comes again is not decoded; 0 turns it off.  This pays
+ * when the same pairs repeat, as with identical Requires of many
+ * packages.  Both strings are hashed on each call, which costs about
+ * as much as comparing a cached Provides string, unless the context is
+ * immutable, in which case the pointers are the keys.  The default size
+ * is taken from the RPMSETCMP_MEMO environment variable.
+ * @return 0 on success, -1 on error
+ */
+int rpmsetcmpCtxMemo(struct rpmsetcmpCtx *ctx, size_t size);
+
+/*
+ * Promise that the set-strings passed through ctx (NULL means the default
+ * context) are neither modified nor freed, as long as the flag is set.
+ * Then a cached Provides string, passed again by the same pointer,
+ * is not compared to its copy in the cache, which saves a few cycles
+ * per byte of the string.
+ */
+void rpmsetcmpCtxImmutable(struct rpmsetcmpCtx *ctx, int immutable);
+
+/*
+ * The decoded Provides can also be kept in a file, which survives across
+ * runs; the file is mapped into memory and consulted before decoding.
+ * The file is named by the RPMSETCMP_STORE environment variable, which is
+ * read on the first cache miss.  rpmsetcmpStoreBuild decodes the set-strings
+ * sv[n] into a new file, which then replaces path.
+ * @return 0 on success, -1 on error (see errno)
+ */
+int rpmsetcmpStoreBuild(const char *path, const char *const *sv, int n);
+
+/*
+ * Decode the Provides set-strings sv[n] up front, on all cores, into
+ * an index shared by all contexts, which replaces the previous one
+ * (n = 0 frees the index).  The index is consulted on a miss in the
+ * cache of the context, before the shared cache, and takes no upkeep
+ * on a hit.  Small sets, which are not cached,
+ * are left out.  The index must not be replaced while the sets are
+ * being compared or prefetched; the strings need not be kept.
+ * @return the number of sets in the index, or -1 on error
+ */
+int rpmsetPreload(const char *const *sv, int n);
+
+/*
+ * Hint that the Provides set-string s is going to be compared soon.
+ * The string is queued for decoding on a helper thread, into the cache
+ * shared by all contexts, so that the decoding overlaps with the caller's
+ * own work.  The string is copied; the hint is dropped when the queue
+ * is full.
+ */
+void rpmsetcmpPrefetch(const char *s);
+
+/*
+ * The counters of ctx (NULL means the default context).  With the
+ * RPMSETCMP_STATS environment variable set, the counters of the default
+ * context are also printed to stderr at exit.  Since reading the clock
+ * takes a while, the decode cycles are only counted with the variable set,
+ * or else from the first call to rpmsetcmpStats on, in any context.
+ */
+struct rpmsetcmpStats {
+    unsigned long calls;
+    unsigned long hits;		/* Provides found in the cache */
+    unsigned long misses;	/* including the two below */
+    unsigned long shared;	/* found in the process-wide cache */
+    unsigned long store;	/* found in the store */
+    unsigned long preloaded;	/* found by rpmsetPreload, not a miss */
+    unsigned long memo;		/* calls answered by the memo */
+    unsigned long filtered;	/* unmet, found before the merge */
+    unsigned long evictions;
+    size_t bytes;		/* taken by the cache entries */
+    size_t shared_bytes;	/* taken by the shared cache entries */
+    unsigned long long cycles;	/* spent decoding */
+    unsigned long downsample[32]; /* sets downsampled by [k] bits */
+    unsigned long stack;	/* Requires decoded on the stack */
+    unsigned long scratch;	/* in the scratch buffer of ctx */
+    unsigned long grow;		/* the scratch buffer grown */
+};
+
+void rpmsetcmpStats(struct rpmsetcmpCtx *ctx, struct rpmsetcmpStats *st);
+
+/*
+ * Compare two set-versions using the cache in ctx.
+ * @return same as rpmsetcmp
+ */
+int rpmsetcmpCtx(struct rpmsetcmpCtx *ctx, const char *s1, const char *s2);
+
+/*
+ * Same as rpmsetcmpN, using the cache in ctx.
+ */
+int rpmsetcmpCtxN(struct rpmsetcmpCtx *ctx,
+		  const char *s1, size_t len1, const char *s2, size_t len2);
+
+/*
+ * Check if Requires (set2) are satisfied by Provides (set1),
+ * i.e. whether set2 is a subset of set1.  This is cheaper than
+ * rpmsetcmp, because the comparison stops at the first element
+ * of set2 which is missing from set1.
+ * @return
+ *  1: set1 >= set2 (satisfied)
+ *  0: otherwise (unmet)
+ * -11: set1 decoder error
+ * -12: set2 decoder error
+ */
+int rpmsetSatisfies(const char *s1, const char *s2);
+
+/*
+ * The sizes of the intersection and differences of two sets,
+ * as they compare (i.e. downsampled to the smaller bpp).
+ */
+struct rpmsetcmpCounts {
+    int common;		/* |set1 & set2| */
+    int only1;		/* |set1 \ set2| */
+    int only2;		/* |set2 \ set1| */
+};
+
+/*
+ * Compare two set-versions and count their common and missing elements.
+ * This takes a full merge, but also tells disjoint sets apart.
+ * @retval cnt		the counts, only valid on success
+ * @return		same as rpmsetcmp, including -3
+ */
+int rpmsetcmpDetail(const char *s1, const char *s2,
+		    struct rpmsetcmpCounts *cnt);
+
+/*
+ * Compare two decoded sets, sorted and unique, with the same bpp.
+ * Unlike with rpmsetcmp, the arrays need no room for sentinels,
+ * so that they can be compared in place (e.g. in read-only memory).
+ * @return same as rpmsetcmp, -13 on bad arguments
+ */
+int rpmsetcmpv(const unsigned *v1, int n1, const unsigned *v2, int n2);
+
 #endif
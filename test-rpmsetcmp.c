@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <getopt.h>
+#include <unistd.h>
+#include "rpmss.h"
+#include "rpmsetcmp.h"
+#include "qsort.h"
+
+static
+int uniqv(int c, unsigned *v)
+{
+    int i, j;
+    for (i = 0, j = 0; i < c; i++) {
+       while (i + 1 < c && v[i] == v[i + 1])
+           i++;
+       v[j++] = v[i];
+    }
+    assert(j <= c);
+    return j;
+}
+
+// reduce full 32-bit hash values to bpp, sort and uniq
+static
+int maskv(const unsigned *v0, int n0, int bpp, unsigned *v)
+{
+    unsigned mask = ~0u;
+    if (bpp < 32)
+	mask = (1u << bpp) - 1;
+    int i;
+    for (i = 0; i < n0; i++)
+	v[i] = v0[i] & mask;
+#define LT(a, b) ((*a) < (*b))
+    QSORT(unsigned, v, n0, LT);
+    return uniqv(n0, v);
+}
+
+static
+char *encode(const unsigned *v0, int n0, int bpp)
+{
+    unsigned v[n0];
+    int n = maskv(v0, n0, bpp, v);
+    int strsize = rpmssEncodeInit(v, n, bpp);
+    // too many values with too small bpp range
+    if (strsize == -5)
+	return NULL;
+    assert(strsize > 0);
+    // the decoder reads two bytes at a time
+    char *s = malloc(strsize + 1);
+    int len = rpmssEncode(v, n, bpp, s);
+    assert(len > 0);
+    // the decoder rejects some parameters chosen for tiny sets
+    if (rpmssDecodeInit(s, len, &bpp) < 0) {
+	free(s);
+	return NULL;
+    }
+    return s;
+}
+
+// reference implementation, with set1 and set2 downsampled to bpp
+static
+int naive_setcmp(const unsigned *v1, int n1, const unsigned *v2, int n2,
+		 int *common)
+{
+    int i = 0, j = 0;
+    int le = 1, ge = 1;
+    *common = 0;
+    while (i < n1 && j < n2) {
+	if (v1[i] < v2[j])
+	    le = 0, i++;
+	else if (v1[i] > v2[j])
+	    ge = 0, j++;
+	else
+	    i++, j++, ++*common;
+    }
+    if (i < n1)
+	le = 0;
+    if (j < n2)
+	ge = 0;
+    if (le && ge)
+	return 0;
+    if (ge)
+	return 1;
+    if (le)
+	return -1;
+    return -2;
+}
+
+static
+unsigned rand32(void)
+{
+    return rand() ^ ((unsigned) rand() << 16);
+}
+
+static
+int rand_range(int min, int max)
+{
+    assert(max >= min);
+    return min + rand() % (max - min + 1);
+}
+
+// a context with its own cache, besides the default one
+static struct rpmsetcmpCtx *ctx;
+static unsigned long ctxcalls;
+
+static
+void test_pair(int size, int min_bpp, int max_bpp)
+{
+    // Provides and Requires are drawn from the same pool of hash values
+    unsigned *pool = malloc(size * sizeof(unsigned));
+    unsigned *P = malloc(size * sizeof(unsigned));
+    unsigned *R = malloc((size + 8) * sizeof(unsigned));
+    int i, nP = 0, nR = 0;
+    int density = rand_range(1, 8);
+    for (i = 0; i < size; i++) {
+	pool[i] = rand32();
+	if (rand() % 8)
+	    P[nP++] = pool[i];
+	if (rand() % 8 < density)
+	    R[nR++] = pool[i];
+    }
+    // sometimes, Requires are only a handful of values
+    if (rand() % 4 == 0 && nR > 8)
+	nR = rand_range(1, 8);
+    // sometimes, make an unmet dependency
+    if (rand() % 2) {
+	int extra = rand_range(1, 8);
+	for (i = 0; i < extra; i++)
+	    R[nR++] = rand32();
+    }
+    // sometimes, compare a set against itself
+    if (rand() % 8 == 0) {
+	memcpy(R, P, nP * sizeof(unsigned));
+	nR = nP;
+    }
+    if (nP == 0 || nR == 0)
+	goto out;
+    int bpp1 = rand_range(min_bpp, max_bpp);
+    int bpp2 = rand_range(min_bpp, max_bpp);
+    if (rand() % 2)
+	bpp2 = bpp1;
+    char *s1 = encode(P, nP, bpp1);
+    char *s2 = encode(R, nR, bpp2);
+    if (s1 && s2) {
+	int bpp = bpp1 < bpp2 ? bpp1 : bpp2;
+	unsigned *v1 = malloc(nP * sizeof(unsigned));
+	unsigned *v2 = malloc(nR * sizeof(unsigned));
+	int n1 = maskv(P, nP, bpp, v1);
+	int n2 = maskv(R, nR, bpp, v2);
+	int common;
+	int cmp = naive_setcmp(v1, n1, v2, n2, &common);
+	// sometimes, Provides are known up front
+	if (rand() % 4 == 0) {
+	    const char *sv[] = { s1, s2, s1 };
+	    assert(rpmsetPreload(sv, 3) >= 0);
+	}
+	// the second call is likely to hit the cache
+	assert(rpmsetcmp(s1, s2) == cmp);
+	assert(rpmsetcmp(s1, s2) == cmp);
+	size_t len1 = strlen(s1), len2 = strlen(s2);
+	assert(rpmsetcmpN(s1, len1, s2, len2) == cmp);
+	char set2[len2 + 6];
+	memcpy(set2, "set:", 4);
+	memcpy(set2 + 4, s2, len2 + 1);
+	set2[len2 + 5] = '\0';
+	assert(rpmsetcmpN(s1, len1, set2, len2 + 4) == cmp);
+	// the length must be that of the string
+	assert(rpmsetcmpN(s1, len1 - 1, s2, len2) == -11);
+	assert(rpmsetcmpN(s1, len1, s2, len2 - 1) == -12);
+	// decoded once, compared both ways
+	struct rpmsetHandle *h1 = rpmsetDecodeHandle(s1);
+	struct rpmsetHandle *h2 = rpmsetDecodeHandle(s2);
+	assert(rpmsetcmpHandles(h1, h2) == cmp);
+	assert(rpmsetcmpHandles(rpmsetHandleLink(h2), h1) ==
+	       (cmp == 1 || cmp == -1 ? -cmp : cmp));
+	assert(rpmsetcmpHandles(h1, h2) == cmp);
+	rpmsetHandleFree(h2);
+	h2 = rpmsetHandleFree(h2);
+	h1 = rpmsetHandleFree(h1);
+	// the strings do not change until they are freed
+	rpmsetcmpCtxImmutable(ctx, 1);
+	assert(rpmsetcmpCtx(ctx, s1, s2) == cmp);
+	assert(rpmsetcmpCtx(ctx, s1, s2) == cmp);
+	rpmsetcmpCtxImmutable(ctx, 0);
+	assert(rpmsetcmpCtxN(ctx, s1, len1, set2, len2 + 4) == cmp);
+	ctxcalls += 3;
+	assert(rpmsetSatisfies(s1, s2) == (cmp >= 0));
+	assert(rpmsetcmpv(v1, n1, v2, n2) == cmp);
+	struct rpmsetcmpCounts cnt;
+	int detail = rpmsetcmpDetail(s1, s2, &cnt);
+	assert(detail == (cmp == -2 && common == 0 ? -3 : cmp));
+	assert(cnt.common == common);
+	assert(cnt.only1 == n1 - common);
+	assert(cnt.only2 == n2 - common);
+	free(v1);
+	free(v2);
+    }
+    free(s1);
+    free(s2);
+out:
+    free(pool);
+    free(P);
+    free(R);
+}
+
+// Requires matches Provides except for the last value, which is above
+// all Provides values; when IFLT runs off the end of Provides, the set
+// is still unmet, even though no mismatch has been seen before
+static
+void test_tail(void)
+{
+    unsigned P[64], R[64];
+    int i;
+    for (i = 0; i < 64; i++)
+	P[i] = R[i] = 4 * i + 1;
+    R[63] = 1000;
+    char *s1 = encode(P, 64, 16);
+    char *s2 = encode(R, 64, 16);
+    assert(s1 && s2);
+    assert(rpmsetcmp(s1, s2) == -2);
+    assert(rpmsetSatisfies(s1, s2) == 0);
+    assert(rpmsetcmpv(P, 64, R, 64) == -2);
+    free(s1);
+    free(s2);
+}
+
+// the sets in the store are found by their strings
+static
+void test_store(void)
+{
+    unsigned P[1024];
+    int i;
+    for (i = 0; i < 1024; i++)
+	P[i] = rand32();
+    char *s1 = encode(P, 1024, 20);
+    char *s2 = encode(P, 64, 20);
+    char *s3 = encode(P + 64, 960, 20);
+    assert(s1 && s2 && s3);
+    char path[] = "/tmp/test-rpmsetcmp.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    const char *sv[] = { s1 };
+    assert(rpmsetcmpStoreBuild(path, sv, 1) == 0);
+    // read on the first miss
+    setenv("RPMSETCMP_STORE", path, 1);
+    struct rpmsetcmpCtx *ctx = rpmsetcmpCtxNew();
+    assert(rpmsetcmpCtx(ctx, s1, s2) == 1);
+    assert(rpmsetcmpCtx(ctx, s3, s2) == -2);
+    struct rpmsetcmpStats st;
+    rpmsetcmpStats(ctx, &st);
+    assert(st.misses == 2 && st.store == 1);
+    unlink(path);
+    free(s1);
+    free(s2);
+    free(s3);
+    rpmsetcmpCtxFree(ctx);
+}
+
+// the preloaded sets are found on a miss, small sets are left out
+static
+void test_preload(void)
+{
+    unsigned P[1024];
+    int i;
+    for (i = 0; i < 1024; i++)
+	P[i] = rand32();
+    char *s1 = encode(P, 1024, 20);
+    char *s2 = encode(P, 64, 20);
+    assert(s1 && s2);
+    const char *sv[] = { s2 };
+    assert(rpmsetPreload(sv, 1) == 0);
+    sv[0] = s1;
+    assert(rpmsetPreload(sv, 1) == 1);
+    struct rpmsetcmpCtx *ctx = rpmsetcmpCtxNew();
+    assert(rpmsetcmpCtx(ctx, s1, s2) == 1);
+    struct rpmsetcmpStats st;
+    rpmsetcmpStats(ctx, &st);
+    assert(st.preloaded == 1 && st.misses == 0);
+    assert(rpmsetPreload(NULL, 0) == 0);
+    free(s1);
+    free(s2);
+    rpmsetcmpCtxFree(ctx);
+}
+
+// a set bigger than the budget is compared, but not cached
+static
+void test_big(void)
+{
+    struct rpmsetcmpCtx *ctx = rpmsetcmpCtxNew();
+    rpmsetcmpCtxBudget(ctx, 4096);
+    unsigned P[4096];
+    int i;
+    for (i = 0; i < 4096; i++)
+	P[i] = rand32();
+    char *s1 = encode(P, 4096, 24);
+    char *s2 = encode(P, 64, 24);
+    assert(s1 && s2);
+    assert(rpmsetcmpCtx(ctx, s1, s2) == 1);
+    assert(rpmsetcmpCtx(ctx, s1, s2) == 1);
+    struct rpmsetcmpStats st;
+    rpmsetcmpStats(ctx, &st);
+    assert(st.bytes == 0 && st.hits == 0);
+    free(s1);
+    free(s2);
+    rpmsetcmpCtxFree(ctx);
+}
+
+// the prefetched set shows up in the shared cache
+static
+void test_prefetch(void)
+{
+    unsigned P[4096];
+    int i;
+    for (i = 0; i < 4096; i++)
+	P[i] = rand32();
+    char *s1 = encode(P, 4096, 24);
+    char *s2 = encode(P, 64, 24);
+    assert(s1 && s2);
+    struct rpmsetcmpStats st;
+    rpmsetcmpStats(NULL, &st);
+    size_t bytes = st.shared_bytes;
+    rpmsetcmpPrefetch(s1);
+    free(s1);
+    s1 = encode(P, 4096, 24);
+    for (i = 0; i < 10000 && st.shared_bytes == bytes; i++) {
+	usleep(1000);
+	rpmsetcmpStats(NULL, &st);
+    }
+    assert(st.shared_bytes > bytes);
+    struct rpmsetcmpCtx *ctx = rpmsetcmpCtxNew();
+    assert(rpmsetcmpCtx(ctx, s1, s2) == 1);
+    rpmsetcmpStats(ctx, &st);
+    assert(st.shared == 1);
+    free(s1);
+    free(s2);
+    rpmsetcmpCtxFree(ctx);
+}
+
+int main(int argc, char **argv)
+{
+    int runs = 9999;
+    int min_bpp = 10;
+    int max_bpp = 32;
+    int min_size = 1;
+    int max_size = 9999;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:b:B:s:S:")) != -1)
+	switch (opt) {
+	case 'n':
+	    runs = atoi(optarg);
+	    break;
+	case 'b':
+	    min_bpp = atoi(optarg);
+	    break;
+	case 'B':
+	    max_bpp = atoi(optarg);
+	    break;
+	case 's':
+	    min_size = atoi(optarg);
+	    break;
+	case 'S':
+	    max_size = atoi(optarg);
+	    break;
+	default:
+	    assert(!"option");
+	}
+    test_store();
+    test_tail();
+    test_preload();
+    test_big();
+    test_prefetch();
+    int i;
+    ctx = rpmsetcmpCtxNew();
+    // exercise eviction by size, the sets bigger than that are not cached
+    rpmsetcmpCtxBudget(ctx, 1 << 20);
+    rpmsetcmpSharedBudget(2 << 20);
+    // the pairs are compared again, sometimes through the memo
+    assert(rpmsetcmpCtxMemo(ctx, 64) == 0);
+    for (i = 0; i < runs; i++) {
+	int size = rand_range(min_size, max_size);
+	test_pair(size, min_bpp, max_bpp);
+    }
+    struct rpmsetcmpStats st;
+    rpmsetcmpStats(ctx, &st);
+    assert(st.calls == ctxcalls);
+    assert(st.bytes <= 1 << 20);
+    assert(st.shared_bytes <= 2 << 20);
+    assert(st.shared + st.store <= st.misses);
+    assert(st.memo > 0 && 3 * st.memo <= 2 * st.calls);
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+    // the clock is on since the first rpmsetcmpStats
+    assert(st.cycles > 0);
+#endif
+    ctx = rpmsetcmpCtxFree(ctx);
+    assert(rpmsetPreload(NULL, 0) == 0);
+    return 0;
+}
+
+// ex: set ts=8 sts=4 sw=4 noet: